@@ -2,12 +2,14 @@
 #include "param.h"
 #include "spinlock.h"
 #include "riscv.h"
+#include "memlayout.h"
 #include "defs.h"
 #include "buf.h"
 
 struct {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    struct buf *buf;      // 缓冲区数组，大小随物理内存伸缩
+    int nbuf;
   
     // Linked list of all buffers, through prev/next.
     // Sorted by how recently the buffer was used.
@@ -24,11 +26,27 @@ binit(void)
 
     initlock(&bcache.lock, "bcache");
 
+    // 每 128MB 物理内存 NBUF 个缓冲区，最多 NBUF_MAX 个
+    uint64 n = NBUF * ((PHYSTOP - KERNBASE) >> 27);
+    if(n < NBUF)
+        n = NBUF;
+    if(n > NBUF_MAX)
+        n = NBUF_MAX;
+    int order = 0;
+    while(((uint64)PGSIZE << order) < n * sizeof(struct buf))
+        order++;
+    bcache.buf = kalloc_pages(order);
+    if(bcache.buf == 0)
+        panic("binit: kalloc");
+    memset(bcache.buf, 0, (uint64)PGSIZE << order);
+    // 块尾凑整多出来的部分不用，缓冲区数不超过上面的上限
+    bcache.nbuf = n;
+
     // Create linked list of buffers
     bcache.head.prev = &bcache.head;
     bcache.head.next = &bcache.head;
     // 头插法初始化缓冲区链表
-    for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+    for(b = bcache.buf; b < bcache.buf+bcache.nbuf; b++){
         b->next = bcache.head.next;
         b->prev = &bcache.head;
         initsleeplock(&b->lock, "buffer");
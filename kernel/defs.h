@@ -9,12 +9,16 @@ extern struct proc *initproc;
 struct context;
 struct spinlock;
 struct proc;
+struct vma;
+struct shmseg;
 struct sleeplock;
 struct stat;
 struct superblock;
 struct file;
 struct inode;
 struct pipe;
+struct kmem_cache;
+struct swapreq;
 
 
 // bio.c
@@ -36,6 +40,39 @@ int             filewrite(struct file*, uint64, int n);
 
 // fs.c
 void            fsinit(int);
+
+// mmap.c
+struct vma*     vma_alloc(struct proc*, uint64);
+uint64          mmap_fault(struct proc*, uint64, int, int);
+void            mmap_prefault(struct proc*, uint64, uint64, int);
+int             mmap_populate_shared(struct proc*);
+int             munmap(struct proc*, uint64, uint64);
+int             mmap_fork(struct proc*, struct proc*);
+void            mmap_exit(struct proc*);
+
+// shm.c
+void            shminit(void);
+void            shm_dup(struct shmseg*);
+void            shm_detach(struct shmseg*);
+
+// swap.c
+void            swapinit(void);
+int             swap_reclaim(int);
+void*           swap_kalloc(int);
+uint64          swap_in(pagetable_t, uint64, pte_t*);
+void            swap_dup(uint64);
+void            swap_free(uint64);
+
+// fdt.c
+#define NVIRTIO 8       // 最多记录的 virtio mmio 槽位数
+struct virtio_mmio {
+    uint64 base;        // 寄存器的物理地址
+    int irq;            // PLIC 中断号
+};
+extern int      ncpu;
+extern struct virtio_mmio virtio_mmio[];
+extern int      nvirtio;
+void            fdtinit(uint64 dtb);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
@@ -62,6 +99,7 @@ void            begin_op(void);
 void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -74,6 +112,26 @@ void            main(void);
 void            kinit(void);
 void*           kalloc(void);
 void            kfree(void *);
+void            kfree_batch(void **, int);
+void            freerange(void *, void *);
+int             kfreemem(void);
+int             kbuddy_order(void *);
+void*           kalloc_zeroed(void);
+void            kzero_refill(void);
+void            kinit_deferred(void);
+void            kpage_ref(void *);
+int             kpage_refcnt(void *);
+void            kpage_split(void *, int);
+void            kpage_settype(void *, int);
+void            kmem_usage(void);
+void*           kalloc_pages(int order);
+void            kfree_pages(void *, int order);
+
+// slab.c
+struct kmem_cache* kmem_cache_create(char *name, uint size, void (*ctor)(void *));
+void*           kmem_cache_alloc(struct kmem_cache *);
+void            kmem_cache_free(struct kmem_cache *, void *);
+void            kmem_cache_dump(void);
 
 // string.c
 void*           memset(void *dst, int c, unsigned long n);
@@ -101,15 +159,36 @@ int             holding(struct spinlock *lk);
 void            push_off(void);
 void            pop_off(void);
 
+// sleeplock.c
+void            acquiresleep(struct sleeplock*);
+void            releasesleep(struct sleeplock*);
+int             holdingsleep(struct sleeplock*);
+void            initsleeplock(struct sleeplock*, char*);
+
 // vm.c
 pte_t*          walk_create(pagetable_t pt, uint64 va);
 pte_t*          walk_lookup(pagetable_t pt, uint64 va);
+pte_t*          walk_create_level(pagetable_t pt, uint64 va, int level);
+pte_t*          walk_lookup_level(pagetable_t pt, uint64 va, int *plevel);
 int             map_region(pagetable_t pt, uint64 va, uint64 pa, uint64 sz, int perm);
 int             unmap_page(pagetable_t pt, uint64 va);
 int             map_page(pagetable_t pagetable, uint64 va, uint64 pa, int perm);
 void            uvmfree(pagetable_t pagetable, uint64 sz);
-void            uvmunmap(pagetable_t pagetable, uint64, uint64 npages, int do_free);
+int             uvmunmap(pagetable_t pagetable, uint64, uint64 npages, int do_free);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+uint64          uvmcow(pagetable_t, uint64);
+uint64          uvmdealloc(pagetable_t, uint64, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvm_split(pagetable_t, uint64);
+uint64          uvm_promote(pagetable_t, uint64, uint64);
+void            asidinit(void);
+void            uvm_switch(struct proc*);
+uint64          uvm_mapzero(pagetable_t, uint64, int, int);
+uint64          uvm_satp(struct proc*);
+void            uvm_changed(pagetable_t, uint64);
+pagetable_t     uvm_kview(pagetable_t);
+int             kvm_mapdevs(pagetable_t);
+void            kvm_switch(void);
 uint64          walkaddr(pagetable_t pt, uint64 va);
 pagetable_t     create_pagetable(void);
 void            destroy_pagetable(pagetable_t pt);
@@ -119,10 +198,20 @@ void            kvminithart(void);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+struct kvec {                   // 分散/聚集拷贝中的一段内核缓冲区
+    void *base;
+    uint64 len;
+};
+int             copyoutv(pagetable_t, uint64, struct kvec *, int);
+int             copyinv(pagetable_t, struct kvec *, int, uint64);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          vmfault(pagetable_t pagetable, uint64 va, int read);
 int             ismapped(pagetable_t, uint64);
 
+// uaccess.S
+uint64          __copy_user(void *, const void *, uint64);
+uint64          __copy_user_str(char *, const char *, uint64);
+
 // proc.c
 int             cpuid(void);
 struct cpu*     mycpu(void);
@@ -132,9 +221,9 @@ void            yield(void);
 void            scheduler(void);
 void            sleep(void *, struct spinlock *);
 void            wakeup(void *);
+void            waitqinit(void);
 struct proc*    myproc(void);
 struct proc*    allocproc(void);
-void            proc_mapstacks(pagetable_t);
 void            procinit(void);
 void            freeproc(struct proc *p);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -145,10 +234,24 @@ void            kexit(int status);
 int             kkill(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
+void            uvm_lock(struct proc*);
+void            uvm_unlock(struct proc*);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
+int             either_copyoutv(int user_dst, uint64 dst, struct kvec *iov, int niov);
+int             either_copyinv(struct kvec *iov, int niov, int user_src, uint64 src);
 void            procdump(void);
 
+// sched.c
+void            rqinit(void);
+void            setrunnable(struct proc *);
+struct proc*    rq_pop(void);
+struct proc*    rq_steal(void);
+void            sched_balance(void);
+void            sched_charge(struct proc *);
+int             setnice(int, int);
+int             getnice(int, int *);
+
 // syscall.c
 void            syscall(void);
 void            argint(int, int*);
@@ -160,6 +263,8 @@ int             fetchaddr(uint64, uint*);
 // trap.c
 extern uint     ticks;
 extern struct spinlock tickslock;
+extern int      trap_trace;
+extern int      trap_flushtlb;
 void            trapinit(void);
 void            trapinithart(void);
 void            prepare_return(void);
@@ -179,6 +284,12 @@ void            test_virtual_memory(void);
 void            test_printf(void);
 void            test_kernel_timer_interrupt(void);
 void            test_entry(void);
+void            test_kalloc_bench(void);
+void            test_buddy(void);
+void            test_cow(void);
+void            test_zero_page(void);
+void            test_syscall_bench(void);
+void            test_superpage(void);
 
 // fs.c
 void            fsinit(int);
@@ -187,5 +298,8 @@ void            fsinit(int);
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
 void            virtio_disk_intr(void);
+void            virtio_disk_page(struct swapreq *);
+void            virtio_disk_wait(struct swapreq *);
+extern int      virtio_disk_irq;
 
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -0,0 +1,160 @@
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "printf.h"
+
+//
+// 解析 QEMU 在启动时通过 a1 传入的扁平设备树（FDT），
+// 得到物理内存大小、virtio mmio 槽位和 hart 数量。
+// 只在 main() 最开始、kinit() 之前调用一次，
+// 之后设备树所在的内存会被当作普通空闲内存使用。
+//
+
+#define FDT_MAGIC       0xd00dfeed
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+#define FDT_MAXDEPTH    8
+
+struct fdt_header {
+    uint32 magic;
+    uint32 totalsize;
+    uint32 off_dt_struct;
+    uint32 off_dt_strings;
+    uint32 off_mem_rsvmap;
+    uint32 version;
+    uint32 last_comp_version;
+    uint32 boot_cpuid_phys;
+    uint32 size_dt_strings;
+    uint32 size_dt_struct;
+};
+
+// 设备树不可用时沿用原来写死的 QEMU virt 布局
+uint64 phystop = KERNBASE + 128*1024*1024;
+int ncpu = 1;
+struct virtio_mmio virtio_mmio[NVIRTIO] = { { VIRTIO0, VIRTIO0_IRQ } };
+int nvirtio = 1;
+
+// 设备树中的数据都是大端序
+static uint32
+be32(const void *p)
+{
+    const uchar *b = p;
+    return ((uint32)b[0] << 24) | ((uint32)b[1] << 16) | ((uint32)b[2] << 8) | b[3];
+}
+
+// 读取 cells 个 32 位单元组成的数
+static uint64
+readcells(const uchar *p, int cells)
+{
+    uint64 v = 0;
+    for(int i = 0; i < cells; i++)
+        v = (v << 32) | be32(p + 4*i);
+    return v;
+}
+
+static int
+prefix(const char *name, const char *pre)
+{
+    return strncmp(name, pre, strlen(pre)) == 0;
+}
+
+void
+fdtinit(uint64 dtb)
+{
+    struct fdt_header *h = (struct fdt_header*)dtb;
+    // 每一层节点给子节点规定的 #address-cells / #size-cells
+    int acells[FDT_MAXDEPTH], scells[FDT_MAXDEPTH];
+    const char *names[FDT_MAXDEPTH];
+    int depth = 0;
+    int cpus = 0, slots = 0;
+    int vslot = -1;     // 当前节点对应的 virtio 槽位，不是 virtio 节点时为 -1
+    uint64 memtop = 0;
+
+    if(dtb == 0 || be32(&h->magic) != FDT_MAGIC) {
+        printf("fdt: no device tree, using defaults\n");
+        return;
+    }
+
+    const uchar *p = (const uchar*)dtb + be32(&h->off_dt_struct);
+    const char *strings = (const char*)dtb + be32(&h->off_dt_strings);
+
+    for(;;) {
+        uint32 tok = be32(p);
+        p += 4;
+        if(tok == FDT_BEGIN_NODE) {
+            const char *name = (const char*)p;
+            p += (strlen(name) + 1 + 3) & ~3;
+            if(depth >= FDT_MAXDEPTH)
+                panic("fdt: too deep");
+            names[depth] = name;
+            // 规范规定的默认值
+            acells[depth] = 2;
+            scells[depth] = 1;
+            depth++;
+            if(depth == 3 && prefix(names[1], "cpus") && prefix(name, "cpu@"))
+                cpus++;
+            vslot = -1;
+            if(prefix(name, "virtio_mmio@") && slots < NVIRTIO) {
+                vslot = slots++;
+                virtio_mmio[vslot].base = 0;
+                virtio_mmio[vslot].irq = 0;
+            }
+        } else if(tok == FDT_END_NODE) {
+            depth--;
+            vslot = -1;
+        } else if(tok == FDT_PROP) {
+            uint32 len = be32(p);
+            const char *pname = strings + be32(p + 4);
+            const uchar *val = p + 8;
+            p += 8 + ((len + 3) & ~3);
+            if(depth == 0)
+                continue;
+
+            const char *node = names[depth-1];
+            // reg 按父节点规定的单元数解释
+            int ac = depth >= 2 ? acells[depth-2] : 2;
+            int sc = depth >= 2 ? scells[depth-2] : 1;
+
+            if(strncmp(pname, "#address-cells", 15) == 0) {
+                acells[depth-1] = be32(val);
+            } else if(strncmp(pname, "#size-cells", 12) == 0) {
+                scells[depth-1] = be32(val);
+            } else if(strncmp(pname, "reg", 4) == 0) {
+                if(depth == 2 && prefix(node, "memory")) {
+                    // 可能有多段，只关心内核所在的那一段
+                    for(uint32 off = 0; off + 4*(ac+sc) <= len; off += 4*(ac+sc)) {
+                        uint64 base = readcells(val + off, ac);
+                        uint64 size = readcells(val + off + 4*ac, sc);
+                        if(base <= KERNBASE && KERNBASE < base + size)
+                            memtop = base + size;
+                    }
+                } else if(vslot >= 0 && len >= 4*ac) {
+                    virtio_mmio[vslot].base = readcells(val, ac);
+                }
+            } else if(strncmp(pname, "interrupts", 11) == 0) {
+                if(vslot >= 0 && len >= 4)
+                    virtio_mmio[vslot].irq = be32(val);
+            }
+        } else if(tok == FDT_NOP) {
+            continue;
+        } else {
+            break;  // FDT_END 或者无法识别
+        }
+    }
+
+    if(memtop > KERNBASE)
+        phystop = memtop;
+    if(cpus > 0)
+        ncpu = cpus < NCPU ? cpus : NCPU;
+    if(slots > 0)
+        nvirtio = slots;
+
+    printf("fdt: memory %ld MB, %d harts, %d virtio slots\n",
+           (phystop - KERNBASE) >> 20, ncpu, nvirtio);
+}
@@ -11,6 +11,7 @@
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define RW_BATCH (PGSIZE / BSIZE)   // readi/writei 每次分散拷贝的块数
 
 struct superblock sb;
 extern char disk[][BSIZE];
@@ -412,24 +413,41 @@ void stati(struct inode *ip, struct stat *st)
  */
 int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-    uint tot, m;
-    struct buf *bp;
+    uint tot, m, done;
+    struct buf *bufs[RW_BATCH];
+    struct kvec iov[RW_BATCH];
+    int nb = 0;
+
     if (off > ip->size || off + n < off)
         return 0;
     if (off + n > ip->size)
         n = ip->size - off;
-    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+    // 每凑够 RW_BATCH 个块（一页）做一次分散拷贝，每个用户页只解析一次
+    for (tot = done = 0; tot < n; tot += m, off += m) {
         uint addr = bmap(ip, off / BSIZE);
         if (addr == 0)
             break;
-        bp = bread(ip->dev, addr);
+        bufs[nb] = bread(ip->dev, addr);
         m = min(n - tot, BSIZE - off % BSIZE);
-        if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-            brelse(bp);
-            tot = -1;
-            break;
+        iov[nb].base = bufs[nb]->data + (off % BSIZE);
+        iov[nb].len = m;
+        if (++nb == RW_BATCH || tot + m == n) {
+            int r = either_copyoutv(user_dst, dst + done, iov, nb);
+            for (int i = 0; i < nb; i++)
+                brelse(bufs[i]);
+            nb = 0;
+            if (r == -1)
+                return -1;
+            done = tot + m;
         }
-        brelse(bp);
+    }
+    // bmap 失败提前结束时，把已经读入的块拷贝出去
+    if (nb > 0) {
+        int r = either_copyoutv(user_dst, dst + done, iov, nb);
+        for (int i = 0; i < nb; i++)
+            brelse(bufs[i]);
+        if (r == -1)
+            return -1;
     }
     return tot;
 }
@@ -446,24 +464,46 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
  */
 int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-    uint tot, m;
-    struct buf *bp;
+    uint tot, m, start;
+    struct buf *bufs[RW_BATCH];
+    struct kvec iov[RW_BATCH];
+    int nb = 0;
+
     if (off > ip->size || off + n < off)
         return -1;
     if (off + n > MAXFILE * BSIZE)
         return -1;
-    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+    // 和 readi 一样成批聚集拷贝，拷贝失败时整批都不写入
+    for (tot = start = 0; tot < n; ) {
         uint addr = bmap(ip, off / BSIZE);
+        if (addr != 0) {
+            bufs[nb] = bread(ip->dev, addr);
+            m = min(n - tot, BSIZE - off % BSIZE);
+            iov[nb].base = bufs[nb]->data + (off % BSIZE);
+            iov[nb].len = m;
+            nb++;
+        }
+        if (nb > 0 && (addr == 0 || nb == RW_BATCH || tot + m == n)) {
+            int r = either_copyinv(iov, nb, user_src, src + start);
+            for (int i = 0; i < nb; i++) {
+                if (r != -1)
+                    log_write(bufs[i]);
+                brelse(bufs[i]);
+            }
+            if (r == -1) {
+                // 回退到这一批开始的位置
+                off -= tot - start;
+                tot = start;
+                break;
+            }
+            nb = 0;
+        }
         if (addr == 0)
             break;
-        bp = bread(ip->dev, addr);
-        m = min(n - tot, BSIZE - off % BSIZE);
-        if (either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
-            brelse(bp);
-            break;
-        }
-        log_write(bp);
-        brelse(bp);
+        tot += m;
+        off += m;
+        if (nb == 0)
+            start = tot;
     }
     if (off > ip->size)
         ip->size = off;
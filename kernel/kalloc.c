@@ -1,95 +1,563 @@
 #include "spinlock.h"
+#include "param.h"
 #include "defs.h"
+#include "page.h"
 
 /**
- * 物理内存页分配器,一个页持有下一个页的地址
+ * 物理内存页分配器（伙伴系统）
+ *
+ * 空闲内存被组织成 2^order 个连续页的块，每个阶有一条空闲链表。
+ * 分配时从满足要求的最小阶开始拆分，释放时与伙伴块合并。
+ * 空闲块的第一个页持有链表指针。
+ *
+ * 每个物理页在 mem_map 中有一个 struct page，记录引用计数、用途和伙伴系统的状态。
+ * kalloc() 把引用计数置为 1，kfree() 把它减 1，减到 0 时才真正释放，
+ * 所以一个页可以通过 kpage_ref() 安全地被多个页表、缓冲区或管道共享。
  */
 struct run {
     struct run *next;
+    struct run *prev;
 };
 
+#define MAX_ORDER 11    // 支持的阶为 0..MAX_ORDER-1，最大块 4MB
+
+#define NPAGES  ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa)  (((uint64)(pa) - KERNBASE) >> PGSHIFT)
+#define IDX2PA(i)   (KERNBASE + ((uint64)(i) << PGSHIFT))
+
+// 物理页元数据，大小取决于设备树给出的内存大小，
+// 由 kinit() 放在内核映像之后并清零，全 0 即表示空闲且不在伙伴系统中
+struct page *mem_map;
+
 struct {
     struct spinlock lock;
-    struct run *freelist;   // 空闲链表的头指针
-    int freepages;        // 空闲页的数量
+    struct run *freelist[MAX_ORDER];    // 每一阶空闲链表的头指针
+    int freepages;        // 伙伴系统中空闲页的数量
+    uint64 base;          // 第一个可分配的物理页（内核映像和 mem_map 之后）
+    uint64 deferred;      // 尚未交给伙伴系统的物理内存 [deferred, deferred_end)
+    uint64 deferred_end;
 } kmem;
 
+// 启动时只把这么多内存立即交给伙伴系统，
+// 其余部分由空闲的 hart 或者内存不足时按块逐步加入
+#define KINIT_EAGER (16 * 1024 * 1024)
+
+// 每个 hart 私有的页缓存（magazine）
+// 快速路径只访问本 hart 的缓存，不需要获取 kmem.lock，
+// 缓存空了或满了才成批地和伙伴系统交换页面。
+#define PCP_BATCH 16    // 每次与伙伴系统交换的页数
+#define PCP_HIGH  64    // 每个 hart 缓存页数的上限，达到后归还一批
+
+struct kmem_pcp {
+    struct run *list;   // 本 hart 缓存的空闲页
+    int count;          // 缓存中的页数
+} __attribute__((aligned(64)));   // 按 cache line 对齐，避免不同 hart 之间的伪共享
+
+static struct kmem_pcp kmem_pcp[NCPU];
+
+// 预先清零的页池，由空闲的 hart 在 scheduler() 中补充，
+// kalloc_zeroed() 优先从这里取页，省去在分配路径上清零整页
+#define ZPOOL_TARGET 64     // 池中期望保有的页数
+#define ZPOOL_REFILL  8     // 空闲 hart 每次最多清零的页数
+
+struct {
+    struct spinlock lock;
+    struct run *list;
+    int count;
+} zpool;
+
+// 把空闲块挂到 order 阶链表的头部，调用者持有 kmem.lock
+static void
+freelist_push(struct run *r, int order)
+{
+    r->prev = 0;
+    r->next = kmem.freelist[order];
+    if(r->next)
+        r->next->prev = r;
+    kmem.freelist[order] = r;
+    pa2page(r)->flags |= PGF_BUDDY;
+    pa2page(r)->order = order;
+}
+
+// 把空闲块从 order 阶链表中摘下，调用者持有 kmem.lock
+static void
+freelist_remove(struct run *r, int order)
+{
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        kmem.freelist[order] = r->next;
+    if(r->next)
+        r->next->prev = r->prev;
+    pa2page(r)->flags &= ~PGF_BUDDY;
+}
+
+static int kmem_grow(void);
+
+// 分配一个 2^order 页的块，调用者持有 kmem.lock
+static struct run*
+buddy_alloc(int order)
+{
+    struct run *r;
+    int k;
+
+    // 找到不小于 order 的最小非空阶，都为空时先把延迟的内存加入进来
+    for(;;) {
+        for(k = order; k < MAX_ORDER && kmem.freelist[k] == 0; k++)
+            ;
+        if(k < MAX_ORDER)
+            break;
+        if(kmem_grow() == 0)
+            return 0;
+    }
+
+    r = kmem.freelist[k];
+    freelist_remove(r, k);
+
+    // 逐级拆分，把后一半作为伙伴挂到低一阶的链表上
+    while(k > order) {
+        k--;
+        freelist_push((struct run*)((char*)r + ((uint64)PGSIZE << k)), k);
+    }
+    kmem.freepages -= 1 << order;
+    return r;
+}
+
+// 释放一个 2^order 页的块，并尽可能与伙伴合并，调用者持有 kmem.lock
+static void
+buddy_free(void *pa, int order)
+{
+    uint64 idx = PA2IDX(pa);
+
+    kmem.freepages += 1 << order;
+    while(order < MAX_ORDER - 1) {
+        uint64 bidx = idx ^ (1UL << order);
+        // 伙伴超出管理范围，或者不是同阶的空闲块，停止合并
+        if(bidx + (1UL << order) > NPAGES ||
+           !(mem_map[bidx].flags & PGF_BUDDY) || mem_map[bidx].order != order)
+            break;
+        freelist_remove((struct run*)IDX2PA(bidx), order);
+        idx &= ~(1UL << order);
+        order++;
+    }
+    freelist_push((struct run*)IDX2PA(idx), order);
+}
+
+// 把 [start, end) 按尽可能大的对齐块直接挂入伙伴系统，调用者持有 kmem.lock
+// 只写每个块首页的链表指针，不触碰页面的其余内容
+static void
+free_bulk(uint64 start, uint64 end)
+{
+    int k;
+
+    while(start + PGSIZE <= end) {
+        for(k = MAX_ORDER - 1; k > 0; k--) {
+            if((PA2IDX(start) & ((1UL << k) - 1)) == 0 && start + ((uint64)PGSIZE << k) <= end)
+                break;
+        }
+        buddy_free((void*)start, k);
+        start += (uint64)PGSIZE << k;
+    }
+}
+
+// 把下一块延迟初始化的内存（最多一个最大阶的块）加入伙伴系统，调用者持有 kmem.lock
+// 返回是否加入了新的内存
+static int
+kmem_grow(void)
+{
+    uint64 start = kmem.deferred;
+    uint64 end;
+
+    if(start >= kmem.deferred_end)
+        return 0;
+    // 到下一个最大块边界为止，这样每次加入的都是完整的对齐块
+    end = IDX2PA((PA2IDX(start) | ((1UL << (MAX_ORDER - 1)) - 1)) + 1);
+    if(end > kmem.deferred_end)
+        end = kmem.deferred_end;
+    free_bulk(start, end);
+    kmem.deferred = end;
+    return 1;
+}
+
 // 初始化物理内存分配器
+// 只立即加入前 KINIT_EAGER 字节，其余的记录下来以后再加入
 void
 kinit(void) {
+    mem_map = (struct page*)PGROUNDUP((uint64)_end);
+    memset(mem_map, 0, NPAGES * sizeof(struct page));
+    kmem.base = PGROUNDUP((uint64)(mem_map + NPAGES));
+
+    uint64 start = kmem.base;
+    uint64 eager = start + KINIT_EAGER;
+
     initlock(&kmem.lock, "kmem");
-    freerange(_end, (void*)PHYSTOP);
+    initlock(&zpool.lock, "zpool");
+    if(eager > PHYSTOP)
+        eager = PHYSTOP;
+    freerange((void*)start, (void*)eager);
+    kmem.deferred = eager;
+    kmem.deferred_end = PHYSTOP;
 }
 
 // 释放一段物理内存区域
 void
 freerange(void *pa_start, void *pa_end) {
-    char *p;
-    p = (char*)PGROUNDUP((uint64)pa_start);
-    for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-        kfree(p);
+    acquire(&kmem.lock);
+    free_bulk(PGROUNDUP((uint64)pa_start), PGROUNDDOWN((uint64)pa_end));
+    release(&kmem.lock);
+}
+
+// 由空闲的 hart 调用，每次把一块延迟的内存加入伙伴系统
+void
+kinit_deferred(void)
+{
+    if(kmem.deferred >= kmem.deferred_end)
+        return;
+    acquire(&kmem.lock);
+    kmem_grow();
+    release(&kmem.lock);
+}
+
+// 从伙伴系统中取一批单页填充本 hart 的缓存
+// 调用者必须已经关闭中断（push_off）
+static void
+pcp_refill(struct kmem_pcp *pc)
+{
+    struct run *r;
+    int n;
+
+    acquire(&kmem.lock);
+    for(n = 0; n < PCP_BATCH && (r = buddy_alloc(0)) != 0; n++) {
+        r->next = pc->list;
+        pc->list = r;
+    }
+    release(&kmem.lock);
+    pc->count += n;
+}
+
+// 把本 hart 缓存中的一批页归还到伙伴系统
+// 调用者必须已经关闭中断（push_off）
+static void
+pcp_drain(struct kmem_pcp *pc, int n)
+{
+    struct run *r;
+    int i;
+
+    acquire(&kmem.lock);
+    for(i = 0; i < n && (r = pc->list) != 0; i++) {
+        pc->list = r->next;
+        buddy_free(r, 0);
+    }
+    release(&kmem.lock);
+    pc->count -= i;
+}
+
+// 新分配的块：首页引用计数为 1，所有页标记为 type
+static void
+page_alloced(void *pa, int order, int type)
+{
+    struct page *pg = pa2page(pa);
+
+    pg->refcnt = 1;
+    for(int i = 0; i < (1 << order); i++)
+        pg[i].type = type;
 }
 
-// 释放一页物理内存
+// 引用计数减 1，返回剩余的引用数；减到 0 时把块内所有页标记为空闲
+static int
+page_put(void *pa)
+{
+    struct page *pg = pa2page(pa);
+    int ref = __sync_sub_and_fetch(&pg->refcnt, 1);
+
+    if(ref < 0) {
+        printf("kfree: page %p is not allocated\n", pa);
+        panic("kfree: refcnt");
+    }
+    if(ref == 0)
+        pg->type = PG_FREE;
+    return ref;
+}
+
+// 释放一页物理内存（引用计数减到 0 时才真正释放）
 void
 kfree(void *pa) {
     struct run *r;
+    struct kmem_pcp *pc;
 
     // 当pa的地址没有和页对齐，或者pa的地址小于内核结束地址，或者pa的地址大于等于物理内存结束地址时，触发panic
-    if(((uint64)pa % PGSIZE) != 0 || (char*)pa < _end || (uint64)pa >= PHYSTOP)
+    if(((uint64)pa % PGSIZE) != 0 || (uint64)pa < kmem.base || (uint64)pa >= PHYSTOP)
     {
         printf("kfree: bad address %p\n", pa);
         panic("kfree: invalid address\n");
     }
 
+    // 还有别的引用，只减少引用计数
+    if(page_put(pa) > 0)
+        return;
+
+#ifdef KALLOC_DEBUG
+    // 填充垃圾数据，便于发现释放后继续使用的错误
     memset(pa, 1, PGSIZE);
+#endif
 
     r = (struct run*)pa;
 
-    acquire(&kmem.lock);
-    r->next = kmem.freelist;
-    kmem.freelist = r;
-    kmem.freepages++;
-    release(&kmem.lock);
+    // 关中断保证在操作本 hart 缓存期间不会被切换到别的 hart
+    push_off();
+    pc = &kmem_pcp[cpuid()];
+    r->next = pc->list;
+    pc->list = r;
+    pc->count++;
+    if(pc->count >= PCP_HIGH)
+        pcp_drain(pc, PCP_BATCH);
+    pop_off();
+}
+
+// 释放一批物理页，效果和逐个 kfree() 相同
+// 只关一次中断，缓存超过上限时一次归还到伙伴系统，用于拆除地址空间
+void
+kfree_batch(void **pa, int n)
+{
+    struct run *r;
+    struct kmem_pcp *pc;
+
+    push_off();
+    pc = &kmem_pcp[cpuid()];
+    for(int i = 0; i < n; i++) {
+        if(((uint64)pa[i] % PGSIZE) != 0 || (uint64)pa[i] < kmem.base || (uint64)pa[i] >= PHYSTOP) {
+            printf("kfree_batch: bad address %p\n", pa[i]);
+            panic("kfree_batch: invalid address\n");
+        }
+        if(page_put(pa[i]) > 0)
+            continue;
+#ifdef KALLOC_DEBUG
+        memset(pa[i], 1, PGSIZE);
+#endif
+        r = (struct run*)pa[i];
+        r->next = pc->list;
+        pc->list = r;
+        pc->count++;
+    }
+    if(pc->count >= PCP_HIGH)
+        pcp_drain(pc, pc->count - PCP_HIGH + PCP_BATCH);
+    pop_off();
 }
 
 // 分配一个物理内存页
 void *
 kalloc(void) {
     struct run *r;
+    struct kmem_pcp *pc;
+
+    push_off();
+    pc = &kmem_pcp[cpuid()];
+    if(pc->list == 0)
+        pcp_refill(pc);
+    r = pc->list;
+    if(r) {
+        pc->list = r->next;
+        pc->count--;
+    }
+    pop_off();
+    if(r)
+        page_alloced(r, 0, PG_KERNEL);
+    return (void*)r;
+}
+
+// 分配一个内容全为 0 的物理页
+void *
+kalloc_zeroed(void)
+{
+    struct run *r;
+
+    acquire(&zpool.lock);
+    r = zpool.list;
+    if(r) {
+        zpool.list = r->next;
+        zpool.count--;
+    }
+    release(&zpool.lock);
 
-    acquire(&kmem.lock);
-    r = kmem.freelist;
     if(r) {
-        kmem.freelist = r->next;
-        kmem.freepages--;
+        // 池中的页只有链表指针不为 0
+        memset(r, 0, sizeof(struct run));
+        pa2page(r)->type = PG_KERNEL;
+        return (void*)r;
     }
+
+    r = kalloc();
+    if(r)
+        memset(r, 0, PGSIZE);
+    return (void*)r;
+}
+
+// 由空闲的 hart 调用，清零一批页放入预清零池
+void
+kzero_refill(void)
+{
+    struct run *r;
+
+    for(int i = 0; i < ZPOOL_REFILL && zpool.count < ZPOOL_TARGET; i++) {
+        if((r = kalloc()) == 0)
+            break;
+        memset(r, 0, PGSIZE);
+        pa2page(r)->type = PG_ZPOOL;
+        acquire(&zpool.lock);
+        r->next = zpool.list;
+        zpool.list = r;
+        zpool.count++;
+        release(&zpool.lock);
+    }
+}
+
+// 返回当前空闲页总数（伙伴系统 + 各 hart 缓存 + 预清零池 + 尚未初始化的部分），
+// 仅用于统计，不保证瞬时精确：空闲 hart 正在清零、还没有放进池中的页不计入
+int
+kfreemem(void)
+{
+    int n = kmem.freepages + (kmem.deferred_end - kmem.deferred) / PGSIZE + zpool.count;
+
+    for(int i = 0; i < NCPU; i++)
+        n += kmem_pcp[i].count;
+    return n;
+}
+
+// pa 是伙伴系统中一个空闲块的首页时返回块的阶，否则返回 -1，供测试检查拆分与合并
+int
+kbuddy_order(void *pa)
+{
+    int order = -1;
+
+    if((uint64)pa < KERNBASE || (uint64)pa >= PHYSTOP)
+        return -1;
+    acquire(&kmem.lock);
+    if(pa2page(pa)->flags & PGF_BUDDY)
+        order = pa2page(pa)->order;
+    release(&kmem.lock);
+    return order;
+}
+
+// 分配 2^order 个物理上连续的页，返回第一个页面的指针
+// order 为 0 时走单页的快速路径
+void *
+kalloc_pages(int order)
+{
+    struct run *r;
+
+    if(order == 0)
+        return kalloc();
+    if(order < 0 || order >= MAX_ORDER)
+        return 0;
+
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
     release(&kmem.lock);
+
+    if(r == 0) {
+        // 伙伴块可能被本 hart 缓存的单页拆散了，归还缓存后再试一次
+        push_off();
+        struct kmem_pcp *pc = &kmem_pcp[cpuid()];
+        pcp_drain(pc, pc->count);
+        pop_off();
+        acquire(&kmem.lock);
+        r = buddy_alloc(order);
+        release(&kmem.lock);
+    }
+    if(r)
+        page_alloced(r, order, PG_KERNEL);
     return (void*)r;
 }
 
-// 连续分配多个物理页,返回第一个页面的指针
-// void *
-// kalloc(int n) {
-//     struct run *first_page, *r;
-
-//     acquire(&kmem.lock);
-//     if(kmem.freepages < n) {
-//         release(&kmem.lock);
-//         return 0; // 分配失败
-//     }
-//     first_page = kmem.freelist;
-//     r = first_page;
-//     for(int i = 1; i < n; i++) {
-//         if(r == 0) {
-//             // 这不应该发生，因为我们已经检查了freepages
-//             release(&kmem.lock);
-//             return 0;
-//         }
-//         r = r->next;
-//     }
-//     kmem.freelist = r->next; // 更新空闲链表的头指针
-//     kmem.freepages -= n;
-//     release(&kmem.lock);
-//     return (void*)first_page;
-// }
\ No newline at end of file
+// 释放由 kalloc_pages(order) 分配的连续页
+void
+kfree_pages(void *pa, int order)
+{
+    if(order == 0) {
+        kfree(pa);
+        return;
+    }
+    if(order < 0 || order >= MAX_ORDER ||
+       ((uint64)pa % ((uint64)PGSIZE << order)) != 0 ||
+       (uint64)pa < kmem.base || (uint64)pa + ((uint64)PGSIZE << order) > PHYSTOP)
+    {
+        printf("kfree_pages: bad address %p order %d\n", pa, order);
+        panic("kfree_pages: invalid address\n");
+    }
+
+    if(page_put(pa) > 0)
+        return;
+    for(int i = 1; i < (1 << order); i++)
+        pa2page(pa)[i].type = PG_FREE;
+
+#ifdef KALLOC_DEBUG
+    memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+
+    acquire(&kmem.lock);
+    buddy_free(pa, order);
+    release(&kmem.lock);
+}
+
+// 增加一个物理页（或多页块首页）的引用计数，用于在多个使用者之间共享
+void
+kpage_ref(void *pa)
+{
+    if(((uint64)pa % PGSIZE) != 0 || (uint64)pa < kmem.base || (uint64)pa >= PHYSTOP)
+        panic("kpage_ref: invalid address");
+    if(__sync_fetch_and_add(&pa2page(pa)->refcnt, 1) <= 0)
+        panic("kpage_ref: page is free");
+}
+
+// 返回物理页当前的引用计数
+int
+kpage_refcnt(void *pa)
+{
+    return pa2page(pa)->refcnt;
+}
+
+// 把 kalloc_pages(order) 得到的、只有一个引用的块拆成 2^order 个独立的页，
+// 之后每页各自用 kfree() 释放，都释放之后伙伴系统会把它们重新合并
+void
+kpage_split(void *pa, int order)
+{
+    struct page *pg = pa2page(pa);
+
+    if(pg->refcnt != 1)
+        panic("kpage_split: shared block");
+    for(int i = 1; i < (1 << order); i++)
+        pg[i].refcnt = 1;
+}
+
+// 设置物理页的用途，用于内存使用统计
+void
+kpage_settype(void *pa, int type)
+{
+    pa2page(pa)->type = type;
+}
+
+// 按用途打印物理内存的使用情况
+void
+kmem_usage(void)
+{
+    static char *names[] = {
+    [PG_FREE]       "free",
+    [PG_KERNEL]     "kernel",
+    [PG_PAGETABLE]  "pagetable",
+    [PG_USER]       "user",
+    [PG_SLAB]       "slab",
+    [PG_ZPOOL]      "zeropool",
+    };
+    int count[NPGTYPE];
+
+    for(int t = 0; t < NPGTYPE; t++)
+        count[t] = 0;
+    for(uint64 i = PA2IDX(kmem.base); i < PA2IDX(kmem.deferred); i++)
+        count[mem_map[i].type]++;
+    count[PG_FREE] += (kmem.deferred_end - kmem.deferred) / PGSIZE;
+
+    printf("kernel image: %d pages\n", (int)PA2IDX(PGROUNDUP((uint64)_end)));
+    printf("mem_map: %d pages\n", (int)((kmem.base - PGROUNDUP((uint64)_end)) / PGSIZE));
+    for(int t = 0; t < NPGTYPE; t++)
+        printf("%s: %d pages\n", names[t], count[t]);
+}
\ No newline at end of file
@@ -6,27 +6,58 @@
 #include "proc.h"
 
 extern struct superblock sb;
+extern uint64 dtb_pa;
 
+// hart 0 完成全局初始化后置 1，其余 hart 在此之前只能等待
+static volatile int started = 0;
+
+// 所有 hart 都从 start() 经 mret 来到这里，hart 0 负责全局的初始化，
+// 其余 hart 只初始化自己的页表寄存器、中断向量和 PLIC，然后各自进入调度器
 void
 main()
 {
+    if(cpuid() != 0) {
+        while(started == 0)
+            ;
+        __sync_synchronize();
+        kvminithart();   // 使用 hart 0 建好的内核页表
+        trapinithart();  // 注册中断向量表
+        plicinithart();  // 打开本 hart 的设备中断
+        w_sstatus(r_sstatus() | SSTATUS_SIE);
+        printf("hart %d starting\n", cpuid());
+        scheduler();
+    }
+
     w_sstatus(r_sstatus() | SSTATUS_SIE);
+    fdtinit(dtb_pa); // 解析设备树，必须在 kinit 之前
+    uint64 t0 = r_time();
     kinit();         // 启用页式管理
+    printf("kinit: %ld ticks\n", r_time() - t0);
     kvminit();       // 创建内核页表并映像内核部分
     kvminithart();   // 把页表设置为内核页表
+    asidinit();      // 探测 ASID 位数
     trapinit();      // 注册中断处理函数
     trapinithart();  // 注册中断向量表
     procinit();      // 初始化进程表
+    plicinit();      // 设置中断优先级
+    plicinithart();  // 打开本 hart 的设备中断
 
     virtio_disk_init(); // 必须在前！
+    swapinit();         // 交换区在同一块磁盘上
 
     binit();    // 初始化缓冲区缓存
     printf("binit done\n");
     iinit();       // 初始化 inode 表
     printf("iinit done\n");
     fileinit();      // file table
+    pipeinit();      // pipe 对象缓存
+    shminit();       // 共享内存段
 
     userinit();      // 第一个用户进程
+
+    // 全局数据结构都已就绪，放行其余的 hart
+    __sync_synchronize();
+    started = 1;
     scheduler();
 
     printf("kernel main exit\n");
@@ -8,7 +8,9 @@
 #define VIRTIO0    0x10001000
 
 #define KERNBASE 0x80000000L // 内核的基地址
-#define PHYSTOP (KERNBASE + 128*1024*1024) // 内核使用的物理内存结束地址 (128MB)
+// 内核使用的物理内存结束地址，启动时由 fdtinit() 根据设备树得到（默认 128MB）
+extern uint64 phystop;
+#define PHYSTOP phystop
 
 extern char _end[]; // 链接脚本提供的符号，内核结束地址
 
@@ -16,9 +18,17 @@ extern char _end[]; // 链接脚本提供的符号，内核结束地址
 // 在用户空间和内核空间中都一样。
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-// 把内核栈映射到trampoline之下，
+// 每个进程有一张内核视图页表：根页表复制自内核页表，
+// 第 0 项和最后一项（各 1GB）指向用户页表的同一棵子树，
+// 这样内核打开 SUM 后可以直接用用户地址访问用户内存。
+// 因此内核自己的映射不能落在这两个 1GB 里，设备除外（它们也被映射进每个用户页表）。
+
+// 把内核栈映射到最高的 1GB 之下，
 // 每个栈都被无效的保护页包围。
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE) // 每个进程的内核栈地址
+// 栈在 allocproc() 时才分配并映射，进程释放后解除映射。
+#define KSTACKTOP (MAXVA - (1L << 30))
+#define KSTACKSIZE (PGSIZE << KSTACKORDER)                      // 内核栈大小（需要 param.h）
+#define KSTACK(p) (KSTACKTOP - ((p)+1) * (KSTACKSIZE + PGSIZE)) // 每个进程的内核栈地址
 
 // 用户内存布局。
 // 地址从零开始:
@@ -29,4 +39,15 @@ extern char _end[]; // 链接脚本提供的符号，内核结束地址
 //   ...
 //   TRAPFRAME 所有的用户进程这个值都相同
 //   TRAMPOLINE (与内核中的 trampoline 页相同)
-#define TRAPFRAME (TRAMPOLINE - PGSIZE) // 用户 trapframe 的虚拟地址
\ No newline at end of file
+#define TRAPFRAME (TRAMPOLINE - PGSIZE) // 用户 trapframe 所在页的虚拟地址
+
+// 堆只能长到 PLIC 之下，再往上是每个用户页表里都有的设备映射
+#define UHEAPTOP PLIC
+
+// mmap 区域从这里向下分配，和 trapframe 之间留一个保护页，最低到 MMAPBASE
+#define MMAPTOP (TRAPFRAME - PGSIZE)
+#define MMAPBASE KSTACKTOP
+
+// trapframe 由 slab 分配，不一定位于页首，
+// 用户页表把它所在的页映射到 TRAPFRAME，这里得到它在用户地址空间中的地址
+#define TRAPFRAME_VA(tf) (TRAPFRAME + ((uint64)(tf) & 0xFFF))
\ No newline at end of file
@@ -0,0 +1,12 @@
+#pragma once
+
+// mmap() 的 prot 参数
+#define PROT_NONE      0x0
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define PROT_EXEC      0x4
+
+// mmap() 的 flags 参数，MAP_SHARED 和 MAP_PRIVATE 必须二选一
+#define MAP_SHARED     0x01   // 写入对共享的进程可见，并写回文件
+#define MAP_PRIVATE    0x02   // 写时复制，写入不影响文件
+#define MAP_ANONYMOUS  0x20   // 不对应文件，页面初始为 0
@@ -0,0 +1,358 @@
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "page.h"
+#include "mman.h"
+
+//
+// mmap/munmap：每个进程在 p->vmas 中记录自己的映射区域，
+// 区域从 MMAPTOP 向下分配，页面在第一次访问时由缺页处理填充。
+// 文件映射的页直接从缓冲区缓存读入，之后用户访问不再经过系统调用；
+// 共享的可写文件映射在 munmap/exit 时把脏页通过 writei 和日志写回。
+//
+// 读入文件页要 ilock/readi，可能睡眠。内核拷贝用户内存时可能持有自旋锁（管道）
+// 或者 inode 的锁（readi/writei 的缓冲区正好映射了同一个文件），
+// 所以拷贝途中的缺页不读文件，由 mmap_prefault() 在加锁之前调入。
+// fork 之前共享映射全部调入，父子进程从此共享同一组物理页。
+//
+
+// 返回进程已用的最低 mmap 地址
+static uint64
+mmap_lowest(struct proc *p)
+{
+    uint64 low = MMAPTOP;
+
+    for(int i = 0; i < NVMA; i++)
+        if(p->vmas[i].used && p->vmas[i].start < low)
+            low = p->vmas[i].start;
+    return low;
+}
+
+// 找到包含 va 的映射区域
+static struct vma*
+vma_find(struct proc *p, uint64 va)
+{
+    for(int i = 0; i < NVMA; i++) {
+        struct vma *v = &p->vmas[i];
+        if(v->used && v->start <= va && va < v->start + v->len)
+            return v;
+    }
+    return 0;
+}
+
+// 在 mmap 区域中分配一段长为 len（页对齐）的地址和一个空闲的 vma
+// 返回的 vma 已经标记为使用，只设置了 start 和 len
+struct vma*
+vma_alloc(struct proc *p, uint64 len)
+{
+    struct vma *v = 0;
+
+    for(int i = 0; i < NVMA; i++) {
+        if(!p->vmas[i].used) {
+            v = &p->vmas[i];
+            break;
+        }
+    }
+    if(v == 0)
+        return 0;
+
+    uint64 low = mmap_lowest(p);
+    if(low < len || low - len < MMAPBASE)
+        return 0;
+
+    memset(v, 0, sizeof(*v));
+    v->used = 1;
+    v->start = low - len;
+    v->len = len;
+    return v;
+}
+
+uint64
+sys_mmap(void)
+{
+    uint64 addr, len, off;
+    int prot, flags, fd;
+    struct proc *p = myproc();
+    struct file *f = 0;
+    struct vma *v;
+
+    argaddr(0, &addr);      // 地址提示，忽略
+    argaddr(1, &len);
+    argint(2, &prot);
+    argint(3, &flags);
+    argint(4, &fd);
+    argaddr(5, &off);
+
+    if(len == 0 || len >= MMAPTOP || (off % PGSIZE) != 0)
+        return -1;
+    if(((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+        return -1;
+    if((flags & MAP_ANONYMOUS) == 0) {
+        if(fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0 || f->type != FD_INODE)
+            return -1;
+        if((prot & PROT_READ) && !f->readable)
+            return -1;
+        // 私有映射的写入不会回到文件，只读打开的文件也可以
+        if((prot & PROT_WRITE) && (flags & MAP_SHARED) && !f->writable)
+            return -1;
+    }
+
+    if((v = vma_alloc(p, PGROUNDUP(len))) == 0)
+        return -1;
+    v->prot = prot;
+    v->flags = flags;
+    v->off = off;
+    v->f = f ? filedup(f) : 0;
+    return v->start;
+}
+
+// mmap 区域的缺页处理，由 vmfault() 在 va 超出 p->sz 时调用
+// read 为 0 表示写访问。cansleep 为 0 时（内核拷贝用户内存途中）不读入文件页。
+// 返回新页的物理地址，不能处理时返回 0
+uint64
+mmap_fault(struct proc *p, uint64 va, int read, int cansleep)
+{
+    struct vma *v = vma_find(p, va);
+    pte_t *pte;
+    char *mem;
+
+    // 共享内存段在 shmat 时已经全部映射
+    if(v == 0 || v->shm)
+        return 0;
+    if(read ? !(v->prot & PROT_READ) : !(v->prot & PROT_WRITE))
+        return 0;
+    va = PGROUNDDOWN(va);
+
+    pte = walk_lookup(p->pagetable, va);
+    if(pte && (*pte & PTE_V)) {
+        // 已经映射：硬件不自动置 D 位时，第一次写入会来到这里
+        if(!read && (*pte & PTE_W) && !(*pte & PTE_D)) {
+            *pte |= PTE_A | PTE_D;
+            uvm_changed(p->pagetable, va);
+            return PTE2PA(*pte);
+        }
+        return 0;
+    }
+
+    if(v->f) {
+        // 从 inode 的数据块读入整页，文件结尾之后的部分清零
+        // 自己已经持有这个 inode 的锁时再 ilock 会死锁
+        if(!cansleep || holdingsleep(&v->f->ip->lock))
+            return 0;
+        if((mem = swap_kalloc(0)) == 0)
+            return 0;
+        ilock(v->f->ip);
+        int r = readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->start), PGSIZE);
+        iunlock(v->f->ip);
+        if(r < 0) {
+            kfree(mem);
+            return 0;
+        }
+        if(r < PGSIZE)
+            memset(mem + r, 0, PGSIZE - r);
+    } else if(read && !(v->flags & MAP_SHARED)) {
+        // 私有匿名映射的读缺页映射零页，可写的映射在第一次写入时复制
+        return uvm_mapzero(p->pagetable, va, (v->prot & PROT_EXEC) ? PTE_R | PTE_X : PTE_R,
+                           v->prot & PROT_WRITE);
+    } else if((mem = swap_kalloc(1)) == 0) {
+        return 0;
+    }
+    kpage_settype(mem, PG_USER);
+
+    // 页表项不允许只写不读
+    int perm = PTE_U | PTE_A;
+    if(v->prot & (PROT_READ | PROT_WRITE))
+        perm |= PTE_R;
+    if(v->prot & PROT_WRITE)
+        perm |= PTE_W | (read ? 0 : PTE_D);
+    if(v->prot & PROT_EXEC)
+        perm |= PTE_X;
+    if(map_page(p->pagetable, va, (uint64)mem, perm) != 0) {
+        kfree(mem);
+        return 0;
+    }
+    return (uint64)mem;
+}
+
+// 调入 v 中 [va, end) 里还没有映射的页，范围截断在 v 之内，write 非 0 时按写访问调入
+// 遇到不能调入的页（权限不对、内存不足）时返回 -1
+static int
+vma_populate(struct proc *p, struct vma *v, uint64 va, uint64 end, int write)
+{
+    if(va < v->start)
+        va = v->start;
+    if(end > v->start + v->len)
+        end = v->start + v->len;
+    for(uint64 a = PGROUNDDOWN(va); a < end; a += PGSIZE) {
+        pte_t *pte = walk_lookup(p->pagetable, a);
+        if(pte && (*pte & PTE_V))
+            continue;
+        if(mmap_fault(p, a, !write, 1) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+// 调入用户缓冲区 [va, va+len) 中属于文件映射、还没有映射的页
+// 系统调用在持有锁之前调用，之后拷贝时就不会因为读文件而睡眠；
+// 不能调入的页留给拷贝时报错
+void
+mmap_prefault(struct proc *p, uint64 va, uint64 len, int write)
+{
+    if(va + len < va)
+        return;
+    uvm_lock(p);
+    for(int i = 0; i < NVMA; i++) {
+        struct vma *v = &p->vmas[i];
+        if(!v->used || v->f == 0)
+            continue;
+        uint64 s = va > v->start ? va : v->start;
+        uint64 e = va + len < v->start + v->len ? va + len : v->start + v->len;
+        if(s < e)
+            vma_populate(p, v, s, e, write);
+    }
+    uvm_unlock(p);
+}
+
+// 把共享映射全部调入，在 fork 创建子进程之前调用
+// 之后父子进程共享同一组物理页，否则各自缺页会读入各自的副本，写入互相看不到
+int
+mmap_populate_shared(struct proc *p)
+{
+    int r = 0;
+
+    uvm_lock(p);
+    for(int i = 0; i < NVMA && r == 0; i++) {
+        struct vma *v = &p->vmas[i];
+        if(!v->used || v->shm || !(v->flags & MAP_SHARED) || !(v->prot & (PROT_READ | PROT_WRITE)))
+            continue;
+        r = vma_populate(p, v, v->start, v->start + v->len, !(v->prot & PROT_READ));
+    }
+    uvm_unlock(p);
+    return r;
+}
+
+// 把共享文件映射中 [va, va+len) 的脏页写回文件
+// 每页一个事务，写回不会让文件变长
+static void
+vma_writeback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+    if(v->f == 0 || !(v->flags & MAP_SHARED) || !(v->prot & PROT_WRITE))
+        return;
+
+    struct inode *ip = v->f->ip;
+    for(uint64 a = va; a < va + len; a += PGSIZE) {
+        pte_t *pte = walk_lookup(p->pagetable, a);
+        if(pte == 0 || (*pte & (PTE_V | PTE_D)) != (PTE_V | PTE_D))
+            continue;
+        uint off = v->off + (a - v->start);
+        begin_op();
+        ilock(ip);
+        if(off < ip->size) {
+            uint n = ip->size - off < PGSIZE ? ip->size - off : PGSIZE;
+            writei(ip, 0, PTE2PA(*pte), off, n);
+        }
+        iunlock(ip);
+        end_op();
+        *pte &= ~PTE_D;
+    }
+}
+
+// 解除 [addr, addr+len) 的映射
+// 只支持去掉一个区域的开头、结尾或者整个区域，不支持在中间挖洞
+int
+munmap(struct proc *p, uint64 addr, uint64 len)
+{
+    struct vma *v;
+
+    if((addr % PGSIZE) != 0 || len == 0)
+        return -1;
+    len = PGROUNDUP(len);
+    if((v = vma_find(p, addr)) == 0 || addr + len > v->start + v->len)
+        return -1;
+    if(addr != v->start && addr + len != v->start + v->len)
+        return -1;
+
+    uvm_lock(p);
+    vma_writeback(p, v, addr, len);
+    int r = uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+    uvm_unlock(p);
+    if(r < 0)
+        return -1;      // 拆分大页时内存不足，映射没有改变
+
+    if(addr == v->start) {
+        v->start += len;
+        v->off += len;
+    }
+    v->len -= len;
+    if(v->len == 0) {
+        if(v->f)
+            fileclose(v->f);
+        if(v->shm)
+            shm_detach(v->shm);
+        v->f = 0;
+        v->shm = 0;
+        v->used = 0;
+    }
+    return 0;
+}
+
+uint64
+sys_munmap(void)
+{
+    uint64 addr, len;
+
+    argaddr(0, &addr);
+    argaddr(1, &len);
+    return munmap(myproc(), addr, len);
+}
+
+// fork 时复制父进程的映射区域
+// 已经调入的页与子进程共享：私有映射写时复制，共享映射直接共享
+// 共享映射已经由 mmap_populate_shared() 全部调入
+// 失败时不修改 np->vmas
+int
+mmap_fork(struct proc *p, struct proc *np)
+{
+    int i;
+
+    for(i = 0; i < NVMA; i++) {
+        struct vma *v = &p->vmas[i];
+        if(v->used &&
+           uvmshare(p->pagetable, np->pagetable, v->start, v->start + v->len,
+                    (v->flags & MAP_PRIVATE) != 0) < 0)
+            goto err;
+    }
+    for(i = 0; i < NVMA; i++) {
+        np->vmas[i] = p->vmas[i];
+        if(np->vmas[i].used && np->vmas[i].f)
+            filedup(np->vmas[i].f);
+        if(np->vmas[i].used && np->vmas[i].shm)
+            shm_dup(np->vmas[i].shm);
+    }
+    return 0;
+
+ err:
+    while(--i >= 0) {
+        struct vma *v = &p->vmas[i];
+        if(v->used)
+            uvmunmap(np->pagetable, v->start, v->len / PGSIZE, 1);
+    }
+    return -1;
+}
+
+// 进程退出时解除所有映射，写回共享映射的脏页
+void
+mmap_exit(struct proc *p)
+{
+    for(int i = 0; i < NVMA; i++)
+        if(p->vmas[i].used)
+            munmap(p, p->vmas[i].start, p->vmas[i].len);
+}
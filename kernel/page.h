@@ -0,0 +1,34 @@
+#pragma once
+#include "types.h"
+#include "riscv.h"
+#include "memlayout.h"
+
+// 物理页的用途，用于按类型统计内存使用情况
+enum pagetype {
+    PG_FREE,        // 空闲（在伙伴系统或 hart 缓存中）
+    PG_KERNEL,      // 内核通用分配
+    PG_PAGETABLE,   // 页表页
+    PG_USER,        // 用户内存
+    PG_SLAB,        // slab 页
+    PG_ZPOOL,       // 预清零池中的页
+    NPGTYPE
+};
+
+#define PGF_BUDDY 0x1   // 该页是伙伴系统中某个空闲块的首页
+
+// 每个物理页对应一个 struct page，覆盖 KERNBASE..PHYSTOP
+// 多页块只在首页上维护引用计数
+struct page {
+    int refcnt;         // 引用计数，只能用原子操作修改
+    uchar type;         // enum pagetype
+    uchar flags;        // PGF_*
+    union {
+        ushort order;   // 空闲块的阶，PGF_BUDDY 时有效
+        ushort nfill;   // 最后一级页表页：缺页填入私有页的次数，见 uvm_promote()
+    };
+};
+
+extern struct page *mem_map;
+
+#define pa2page(pa) (&mem_map[((uint64)(pa) - KERNBASE) >> PGSHIFT])
+#define page2pa(pg) (KERNBASE + ((uint64)((pg) - mem_map) << PGSHIFT))
@@ -8,8 +8,16 @@
 #define MAXARG       32  // exec参数最大数量
 #define MAXOPBLOCKS  10  // 文件系统操作最多写入的块数
 #define LOGBLOCKS    (MAXOPBLOCKS*3)  // 磁盘日志中的最大数据块数
-#define NBUF         (MAXOPBLOCKS*3)  // 磁盘块缓存大小
+#define NBUF         (MAXOPBLOCKS*3)  // 磁盘块缓存大小（每 128MB 内存）
+#define NBUF_MAX     1024  // 按内存伸缩后磁盘块缓存的上限
 #define FSSIZE       2000  // 文件系统块数
 #define MAXPATH      128   // 文件路径名最大长度
 #define USERSTACK    1     // 用户栈页数
+#define KSTACKORDER  2     // 每个内核栈 2^KSTACKORDER 页
+#define NKSTACKCACHE 4     // 缓存的空闲内核栈个数
+#define NVMA         16    // 每个进程最多的 mmap 区域数
+#define NSHM         16    // 系统中共享内存段的最大数量
+#define SWAPSTART    FSSIZE  // 交换区在磁盘上的起始块号，紧接文件系统之后
+#define NSWAP        4096  // 交换区的页数（16MB）
+#define NSWAPIO      8     // 同时进行的换出写盘请求数
 
@@ -19,6 +19,23 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache *pipe_cache;
+
+// pipe 对象的构造函数：锁在对象的整个生命周期内保持初始化状态
+static void
+pipe_ctor(void *obj)
+{
+  struct pipe *pi = obj;
+
+  initlock(&pi->lock, "pipe");
+}
+
+void
+pipeinit(void)
+{
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), pipe_ctor);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,13 +45,12 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = (struct pipe*)kmem_cache_alloc(pipe_cache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
-  initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
   (*f0)->writable = 0;
@@ -47,7 +63,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,16 +84,35 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   } else
     release(&pi->lock);
 }
 
+// 环形缓冲区中从位置 pos 开始的 n 个字节，回绕时分成两段
+static int
+pipe_iov(struct pipe *pi, uint pos, uint n, struct kvec *iov)
+{
+  uint off = pos % PIPESIZE;
+  uint first = PIPESIZE - off;
+
+  iov[0].base = &pi->data[off];
+  if(n <= first){
+    iov[0].len = n;
+    return 1;
+  }
+  iov[0].len = first;
+  iov[1].base = &pi->data[0];
+  iov[1].len = n - first;
+  return 2;
+}
+
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i = 0;
   struct proc *pr = myproc();
+  struct kvec iov[2];
 
   acquire(&pi->lock);
   while(i < n){
@@ -89,11 +124,15 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // 一次填满缓冲区中所有的空闲空间
+      uint m = PIPESIZE - (pi->nwrite - pi->nread);
+      if(m > n - i)
+        m = n - i;
+      int niov = pipe_iov(pi, pi->nwrite, m, iov);
+      if(copyinv(pr->pagetable, iov, niov, addr + i) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
@@ -105,9 +144,9 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, niov;
   struct proc *pr = myproc();
-  char ch;
+  struct kvec iov[2];
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -117,13 +156,14 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
-      break;
-  }
+  // 一次取走缓冲区中的所有数据（最多 n 字节）
+  i = pi->nwrite - pi->nread;  //DOC: piperead-copy
+  if(i > n)
+    i = n;
+  niov = pipe_iov(pi, pi->nread, i, iov);
+  if(copyoutv(pr->pagetable, addr, iov, niov) == -1)
+    i = 0;
+  pi->nread += i;
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
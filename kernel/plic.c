@@ -13,7 +13,9 @@ plicinit(void)
 {
   // set desired IRQ priorities non-zero (otherwise disabled).
   *(uint32*)(PLIC + UART0_IRQ*4) = 1;
-  *(uint32*)(PLIC + VIRTIO0_IRQ*4) = 1;
+  // 所有 virtio 槽位的中断号都来自设备树
+  for(int i = 0; i < nvirtio; i++)
+    *(uint32*)(PLIC + virtio_mmio[i].irq*4) = 1;
 }
 
 void
@@ -23,7 +25,11 @@ plicinithart(void)
   
   // set enable bits for this hart's S-mode
   // for the uart and virtio disk.
-  *(uint32*)PLIC_SENABLE(hart) = (1 << UART0_IRQ) | (1 << VIRTIO0_IRQ);
+  uint32 enable = 1 << UART0_IRQ;
+  for(int i = 0; i < nvirtio; i++)
+    if(virtio_mmio[i].irq < 32)
+      enable |= 1 << virtio_mmio[i].irq;
+  *(uint32*)PLIC_SENABLE(hart) = enable;
 
   // set this hart's S-mode priority threshold to 0.
   *(uint32*)PLIC_SPRIORITY(hart) = 0;
@@ -4,6 +4,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "page.h"
 
 struct cpu cpus[NCPU];
 struct proc proc[NPROC];
@@ -19,23 +20,79 @@ extern char trampoline[]; // trampoline.S
 
 struct spinlock wait_lock;
 
+// trapframe 只有两百多字节，用 slab 分配，不再独占一页
+static struct kmem_cache *trapframe_cache;
+
 extern char _binary_user_initcode_start[];
 extern char _binary_user_initcode_end[];
 
-void
-proc_mapstacks(pagetable_t kpgtbl)
+// 空闲内核栈的缓存，每个栈是 2^KSTACKORDER 个连续物理页，
+// 用栈底的第一个字串成链表。
+// lock 同时保护对内核页表中栈区域的修改。
+static struct {
+  struct spinlock lock;
+  void *list;
+  int count;
+} kstacks;
+
+// 为进程分配内核栈并映射到 KSTACK(p)，下面的保护页保持无效
+static int
+kstack_map(struct proc *p)
 {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    // kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-    if(map_page(kpgtbl, va, (uint64)pa, PTE_R | PTE_W) != 0)
-      panic("mapstack");
+  void *pa;
+
+  acquire(&kstacks.lock);
+  if((pa = kstacks.list) != 0){
+    kstacks.list = *(void**)pa;
+    kstacks.count--;
+  }
+  release(&kstacks.lock);
+
+  if(pa == 0 && (pa = kalloc_pages(KSTACKORDER)) == 0)
+    return -1;
+
+  acquire(&kstacks.lock);
+  if(map_region(kernel_pagetable, p->kstack, (uint64)pa, KSTACKSIZE, PTE_R | PTE_W) != 0){
+    // 只可能是中间页表分配失败，撤销已经建立的部分映射
+    for(uint64 va = p->kstack; va < p->kstack + KSTACKSIZE; va += PGSIZE)
+      unmap_page(kernel_pagetable, va);
+    release(&kstacks.lock);
+    kfree_pages(pa, KSTACKORDER);
+    return -1;
   }
+  release(&kstacks.lock);
+  p->kstack_pa = (uint64)pa;
+  return 0;
+}
+
+// 解除进程内核栈的映射，物理页放回缓存或者还给伙伴系统
+static void
+kstack_unmap(struct proc *p)
+{
+  void *pa = (void*)p->kstack_pa;
+
+  if(pa == 0)
+    return;
+  p->kstack_pa = 0;
+
+  // 只刷新本 hart。别的 hart 上残留的表项带着 p 的旧 ASID，
+  // 下一个使用这个槽位的进程第一次被调度时会分配新的 ASID，不会命中它们；
+  // 不支持 ASID 时 uvm_switch() 每次都刷新整个 TLB
+  acquire(&kstacks.lock);
+  for(uint64 va = p->kstack; va < p->kstack + KSTACKSIZE; va += PGSIZE){
+    unmap_page(kernel_pagetable, va);
+    sfence_vma_addr(va);
+  }
+  if(kstacks.count < NKSTACKCACHE){
+    *(void**)pa = kstacks.list;
+    kstacks.list = pa;
+    kstacks.count++;
+    pa = 0;
+  }
+  release(&kstacks.lock);
+
+  if(pa)
+    kfree_pages(pa, KSTACKORDER);
 }
 
 // 初始化进程管理
@@ -46,11 +103,15 @@ procinit(void)
 
     initlock(&pid_lock, "nextpid");
     initlock(&wait_lock, "wait_lock");
+    initlock(&kstacks.lock, "kstacks");
+    trapframe_cache = kmem_cache_create("trapframe", sizeof(struct trapframe), 0);
     for(p = proc; p < &proc[NPROC]; p++) {
         initlock(&p->lock, "proc");
         p->state = UNUSED;
         p->kstack = KSTACK((int) (p - proc));
     }
+    rqinit();
+    waitqinit();
 }
 
 // 得到当前的cpu id
@@ -84,7 +145,8 @@ void
 yield() {
     struct proc *p = myproc();
     acquire(&p->lock);
-    p->state = RUNNABLE;
+    sched_charge(p);
+    setrunnable(p);
     sched();
     release(&p->lock);
 }
@@ -121,6 +183,7 @@ sched(void)
 }
 
 
+// 每个 hart 的调度循环，从本 hart 的就绪队列中依次取出进程运行
 void
 scheduler(void)
 {
@@ -135,30 +198,31 @@ scheduler(void)
     intr_on();
     intr_off();
 
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      // printf("[scheduler]: check pid=%d state=%d\n", p->pid, p->state);
-      if(p->state == RUNNABLE) {
-        // 切换到选中的进程。进程自己负责释放锁，
-        // 并在跳回调度器前重新获取锁。
-        p->state = RUNNING;
-        c->proc = p;
-        printf("before switch to pid=%d\n", p->pid);
-
-        // 值得注意的是，对于 cpu 的 context 来说，执行这个汇编代码之前，会把ra设置为下一条指令的地址
-        proc_switch(&c->context, &p->context);
-
-        // 进程暂时运行结束，应该在跳回调度器前修改自己的状态。
-        c->proc = 0;
-        found = 1;
-      }
+    // 本 hart 的队列空了就去别的队列偷一个
+    if((p = rq_pop()) != 0 || (p = rq_steal()) != 0) {
+      // 切换到选中的进程。进程自己负责释放锁，
+      // 并在跳回调度器前重新获取锁。
+      p->state = RUNNING;
+      c->proc = p;
+
+      // 换到进程的内核视图页表，它在内核中可以直接访问自己的用户内存
+      uvm_switch(p);
+
+      // 值得注意的是，对于 cpu 的 context 来说，执行这个汇编代码之前，会把ra设置为下一条指令的地址
+      proc_switch(&c->context, &p->context);
+
+      // 进程暂时运行结束，应该在跳回调度器前修改自己的状态。
+      // 它的页表可能随后被父进程释放，先换回内核页表
+      kvm_switch();
+      c->proc = 0;
       // 这一行代码价值千金啊！！！
       // 他保证了一个进程在调度后，能正确释放锁
       // 同时这也和sched() 中，要求发生调度的进程必须持有锁是一致的
       release(&p->lock);
-    }
-    if(found == 0) {
+    } else {
+      // 空闲时顺便完成延迟的物理内存初始化，并补充预清零的页池
+      kinit_deferred();
+      kzero_refill();
       // 没有可运行的进程；让当前 CPU 停止运行，直到有中断发生。
       asm volatile("wfi");
     }
@@ -200,45 +264,116 @@ forkret(void)
 
   // 返回用户空间，模拟 usertrap() 的返回。
   prepare_return();
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvm_satp(p);
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
   ((void (*)(uint64))trampoline_userret)(satp);
 }
 
+// 睡眠的进程按 chan 的地址散列到等待队列中，wakeup(chan) 只查看对应的一个桶，
+// 开销与真正在等待的进程数成正比，没有人等待时只是一次加锁。
+// 锁的顺序：先桶的锁，再 p->lock。
+#define WAITQ_BITS 6
+#define NWAITQ (1 << WAITQ_BITS)
+
+static struct waitq {
+    struct spinlock lock;
+    struct proc *head;          // 睡在散列到这个桶的 chan 上的进程，双向链表
+} waitq[NWAITQ];
+
+static struct waitq*
+waitq_of(void *chan)
+{
+    // 乘法散列，取高位，相邻的地址也能分散到不同的桶
+    return &waitq[((uint64)chan * 0x9E3779B97F4A7C15UL) >> (64 - WAITQ_BITS)];
+}
+
+// 把 p 挂到等待队列 wq 上，调用者持有 wq->lock
+static void
+waitq_insert(struct waitq *wq, struct proc *p)
+{
+    p->wqprev = 0;
+    p->wqnext = wq->head;
+    if(wq->head)
+        wq->head->wqprev = p;
+    wq->head = p;
+    p->onwq = 1;
+}
+
+// 把 p 从等待队列 wq 上摘下，调用者持有 wq->lock
+static void
+waitq_remove(struct waitq *wq, struct proc *p)
+{
+    if(p->wqprev)
+        p->wqprev->wqnext = p->wqnext;
+    else
+        wq->head = p->wqnext;
+    if(p->wqnext)
+        p->wqnext->wqprev = p->wqprev;
+    p->wqnext = p->wqprev = 0;
+    p->onwq = 0;
+}
+
+void
+waitqinit(void)
+{
+    for(int i = 0; i < NWAITQ; i++)
+        initlock(&waitq[i].lock, "waitq");
+}
+
 // 进程睡眠，等待chan事件
 void sleep(void *chan, struct spinlock *lk) {
     struct proc *p = myproc();
+    struct waitq *wq = waitq_of(chan);
 
+    // 先持有桶的锁再放开 lk，之后的 wakeup(chan) 一定能在桶中找到自己；
     // 必须持有p->lock修改状态
+    acquire(&wq->lock);
     acquire(&p->lock);
     release(lk);
 
     p->chan = chan;
     p->state = SLEEPING;
+    waitq_insert(wq, p);
+    release(&wq->lock);
+    sched_charge(p);
 
     sched();
 
     // 唤醒后清理chan
     p->chan = 0;
 
-    release(&p->lock);
+    // 被 wakeup() 唤醒时已经从队列上摘下；被 kkill() 唤醒时还在队列上，自己摘下来
+    if(p->onwq) {
+        release(&p->lock);
+        acquire(&wq->lock);
+        waitq_remove(wq, p);
+        release(&wq->lock);
+    } else {
+        release(&p->lock);
+    }
     acquire(lk);
 }
 
+// 唤醒所有睡在 chan 上的进程，只查看 chan 所在的桶
 void 
 wakeup(void *chan)
 {
-    struct proc *p;
-
-    for(p = proc; p < &proc[NPROC]; p++) {
-        if(p != myproc()) {
-            acquire(&p->lock);
-            if(p->state == SLEEPING && p->chan == chan) {
-                p->state = RUNNABLE;
-            }
-            release(&p->lock);
+    struct waitq *wq = waitq_of(chan);
+    struct proc *p, *next;
+
+    acquire(&wq->lock);
+    for(p = wq->head; p; p = next) {
+        next = p->wqnext;
+        if(p->chan != chan || p == myproc())
+            continue;   // 同一个桶里别的 chan
+        acquire(&p->lock);
+        if(p->state == SLEEPING && p->chan == chan) {
+            waitq_remove(wq, p);
+            setrunnable(p);
         }
+        release(&p->lock);
     }
+    release(&wq->lock);
 }
 
 pagetable_t
@@ -258,12 +393,22 @@ proc_pagetable(struct proc *p)
         return 0;
     }
 
-    if(map_page(pagetable, TRAPFRAME, (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
+    // trapframe 所在的页映射到 TRAPFRAME，同页中其他进程的 trapframe 没有 PTE_U，用户态不可见
+    if(map_page(pagetable, TRAPFRAME, PGROUNDDOWN((uint64)(p->trapframe)), PTE_R | PTE_W) < 0){
         unmap_page(pagetable, TRAMPOLINE);
         uvmfree(pagetable, 0);
         return 0;
     }
 
+    // 内核视图页表借用用户页表的第 0 项，设备也要映射进来（没有 PTE_U）
+    // 设备映射都是叶子，uvmfree 不会释放设备本身
+    if(kvm_mapdevs(pagetable) != 0){
+        unmap_page(pagetable, TRAMPOLINE);
+        unmap_page(pagetable, TRAPFRAME);
+        uvmfree(pagetable, 0);
+        return 0;
+    }
+
     return pagetable;
 }
 
@@ -286,17 +431,17 @@ userinit(void)
 
   // p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   uint size = (uint)(_binary_user_initcode_end - _binary_user_initcode_start);
 
   uvminit(p->pagetable, _binary_user_initcode_start, size);
 
   // 为栈分配一页内存
-  char *stackpage = kalloc();
+  char *stackpage = kalloc_zeroed();
   if(stackpage == 0)
     panic("userinit: kalloc for stack");
-  memset(stackpage, 0, PGSIZE);
+  kpage_settype(stackpage, PG_USER);
   if(map_page(p->pagetable, PGSIZE, (uint64)stackpage, PTE_W|PTE_R|PTE_U) != 0)
     panic("userinit: stack mappages");
   
@@ -329,7 +474,7 @@ allocpid(void)
  * allocproc - 分配一个新的进程
  * 1. 遍历进程表，找到一个状态为 UNUSED 的进程
  * 2. 分配一个新的 PID
- * 3. 分配内核栈、页表和 trapframe
+ * 3. 分配内核栈（按需映射）、页表和 trapframe
  * 4. 初始化进程的上下文，使其能从 forkret 返回，并初始化自己的栈指针
  */
 struct proc*
@@ -345,13 +490,21 @@ allocproc(void)
             printf("[TEXT] allocproc: pid=%d\n", p->pid);
             p->state = USED;
 
-            // 给内核的页表添加该进程的 trap 帧的物理页
-            p->trapframe = (struct trapframe *)kalloc();
+            // 分配并映射内核栈
+            if(kstack_map(p) != 0) {
+                freeproc(p);
+                release(&p->lock);
+                return 0;
+            }
+
+            // 分配该进程的 trap 帧
+            p->trapframe = (struct trapframe *)kmem_cache_alloc(trapframe_cache);
             if(p->trapframe == 0) {
                 freeproc(p);
                 release(&p->lock);
                 return 0;
             }
+            memset(p->trapframe, 0, sizeof(struct trapframe));
             // 分配用户页表
             p->pagetable = proc_pagetable(p);
             if(p->pagetable == 0) {
@@ -359,10 +512,22 @@ allocproc(void)
                 release(&p->lock);
                 return 0;
             }
+            // 在内核中运行时使用的页表
+            p->kpagetable = uvm_kview(p->pagetable);
+            if(p->kpagetable == 0) {
+                freeproc(p);
+                release(&p->lock);
+                return 0;
+            }
             // 初始化上下文
             memset(&p->context, 0, sizeof(p->context));
+            p->asid = 0;            // 第 0 代，第一次被调度时分配
+            p->lastcpu = -1;
+            p->tlbflush = 0;
+            p->nice = 0;
+            p->vruntime = 0;
             p->context.ra = (uint64)forkret;
-            p->context.sp = p->kstack + PGSIZE;
+            p->context.sp = p->kstack + KSTACKSIZE;
 
             return p;
         } else
@@ -374,17 +539,22 @@ allocproc(void)
 void
 freeproc(struct proc *p)
 {
-    if(p->trapframe) kfree((void*)p->trapframe);
+    if(p->trapframe) kmem_cache_free(trapframe_cache, p->trapframe);
     p->trapframe = 0;
+    if(p->kpagetable) kfree(p->kpagetable);    // 只有根页表属于它
+    p->kpagetable = 0;
     if(p->pagetable) proc_freepagetable(p->pagetable, p->sz);
     p->pagetable = 0;
+    kstack_unmap(p);
     p->sz = 0;
     p->pid = 0;
     p->parent = 0;
     p->name[0] = 0;
+    memset(p->vmas, 0, sizeof(p->vmas));
     p->chan = 0;
     p->killed = 0;
     p->xstate = 0;
+    p->vmlocked = 0;
     p->state = UNUSED;
 }
 
@@ -398,18 +568,30 @@ kfork(void)
 
     printf("[DEBUG] in kfork, pid: %d\n", p->pid);
 
-    if((np = allocproc()) == 0) {
+    // 共享映射先全部调入，父子进程才能共享同一组页；allocproc() 之后持有自旋锁，不能再读文件
+    if(mmap_populate_shared(p) < 0)
+        return -1;
+
+    // 内存不足时先换出一些页再试一次
+    if((np = allocproc()) == 0 && (swap_reclaim(8) == 0 || (np = allocproc()) == 0)) {
         return -1;
     }
 
-    // 先赋值一份映射
-    if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
+    // 先赋值一份映射，父进程的页表也会改成写时复制，要持有它的地址空间锁
+    // 共享 mmap 区域中已经调入的页
+    uvm_lock(p);
+    if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 || mmap_fork(p, np) < 0) {
+        uvm_unlock(p);
         freeproc(np);
         release(&np->lock);
         return -1;
     }
+    uvm_unlock(p);
     // 赋值进程内存空间大小
     np->sz = p->sz;
+    // 子进程继承 nice，vruntime 从父进程的开始，fork 不能用来多占 CPU
+    np->nice = p->nice;
+    np->vruntime = p->vruntime;
     // 赋值trap帧内容
    *(np->trapframe) = *(p->trapframe);
     // 让子进程的返回值为0
@@ -434,7 +616,7 @@ kfork(void)
     release(&wait_lock);
 
     acquire(&np->lock);
-    np->state = RUNNABLE;
+    setrunnable(np);
     release(&np->lock);
 
     return pid;
@@ -459,6 +641,9 @@ reparent(struct proc *p)
 void kexit(int status) {
     struct proc *p = myproc();
 
+    // 解除 mmap 映射，写回共享文件映射的脏页
+    mmap_exit(p);
+
     // 关闭所有打开的文件
     // for(int fd = 0; fd < NOFILE; fd++) {
     //     if(p->ofile[fd]) { fileclose(p->ofile[fd]); p->ofile[fd] = 0; }
@@ -498,6 +683,10 @@ int kwait(uint64 status_addr) {
     struct proc *p = myproc();
     int havekids, pid;
 
+    // 下面在持有自旋锁时写回退出状态，status_addr 在文件映射中时先调入
+    if(status_addr)
+        mmap_prefault(p, status_addr, sizeof(int), 1);
+
     // 在子进程
     acquire(&wait_lock);
 
@@ -567,7 +756,7 @@ kkill(int pid)
     if(p->pid == pid){
       p->killed = 1;              // 标记为已被杀死，稍后由用户态返回路径处理退出
       if(p->state == SLEEPING){   // 若进程在 sleep() 中，唤醒它以便尽快处理退出
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;                   // 成功找到并标记
@@ -585,6 +774,28 @@ setkilled(struct proc *p)
   release(&p->lock);
 }
 
+// 进程的地址空间锁：修改自己页表的操作（缺页、写时复制、大页合并和拆分、
+// sbrk 缩小、mmap 区域的调入和解除）期间持有，swap_reclaim() 跳过持有它的进程。
+// 只有进程自己会加这把锁，可以嵌套，持有期间可以睡眠。
+// 回收者扫描一个进程时一直持有 p->lock，所以加锁要等它扫描完这个进程
+void
+uvm_lock(struct proc *p)
+{
+  acquire(&p->lock);
+  p->vmlocked++;
+  release(&p->lock);
+}
+
+void
+uvm_unlock(struct proc *p)
+{
+  acquire(&p->lock);
+  if(p->vmlocked <= 0)
+    panic("uvm_unlock");
+  p->vmlocked--;
+  release(&p->lock);
+}
+
 int
 either_copyout(int user_dst, uint64 dst, void *src, uint64 len)
 {
@@ -612,6 +823,34 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// 把多段内核缓冲区依次拷贝到连续的用户或内核地址 dst
+int
+either_copyoutv(int user_dst, uint64 dst, struct kvec *iov, int niov)
+{
+  struct proc *p = myproc();
+  if(user_dst)
+    return copyoutv(p->pagetable, dst, iov, niov);
+  for(int i = 0; i < niov; i++){
+    memmove((char *)dst, iov[i].base, iov[i].len);
+    dst += iov[i].len;
+  }
+  return 0;
+}
+
+// 把连续的用户或内核地址 src 依次拷贝到多段内核缓冲区
+int
+either_copyinv(struct kvec *iov, int niov, int user_src, uint64 src)
+{
+  struct proc *p = myproc();
+  if(user_src)
+    return copyinv(p->pagetable, iov, niov, src);
+  for(int i = 0; i < niov; i++){
+    memmove(iov[i].base, (char *)src, iov[i].len);
+    src += iov[i].len;
+  }
+  return 0;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
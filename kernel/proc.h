@@ -41,6 +41,18 @@ struct trapframe {
     uint64 t3, t4, t5, t6;
 };
 
+// 进程的一个 mmap 区域
+struct vma {
+    int used;
+    uint64 start;               // 起始虚拟地址，页对齐
+    uint64 len;                 // 长度，页对齐
+    int prot;                   // PROT_*
+    int flags;                  // MAP_*
+    struct file *f;             // 映射的文件，匿名映射为 0
+    struct shmseg *shm;         // 挂接的共享内存段，否则为 0
+    uint64 off;                 // start 对应的文件偏移
+};
+
 struct proc {
     struct spinlock lock;
 
@@ -49,17 +61,37 @@ struct proc {
     void *chan;                 // 如果进程在睡眠，则为睡眠通道，否则为0，用于同步的唤醒
     int killed;                 // 如果进程被杀死，则为非0
     int xstate;                 // 进程退出状态，供父进程使用
+    int vmlocked;               // 地址空间锁的嵌套深度，见 uvm_lock()
     int pid;                    // 进程ID
 
     struct proc *parent;        // 父进程指针
 
-    uint64 kstack;              // 进程内核栈虚拟地址
+    uint64 kstack;              // 进程内核栈虚拟地址（栈底）
+    uint64 kstack_pa;           // 内核栈的物理地址，未分配时为 0
     uint64 sz;                  // 进程内存大小（字节）
     pagetable_t pagetable;      // 进程页表
+    pagetable_t kpagetable;     // 内核视图页表，在内核中运行时使用，包含用户空间的映射
     struct trapframe *trapframe;// 进程trapframe
     struct context context;     // 进程上下文，用于切换
     struct file *ofile[NOFILE];  // Open files
     struct inode *cwd;           // Current directory
+    struct vma vmas[NVMA];      // mmap 区域
+    uint64 asid;                // 高位是分配时的代数，低 16 位是硬件 ASID
+    int lastcpu;                // 上一次在哪个 hart 上运行
+    int tlbflush;               // 页表被换出修改过，下次运行前刷新本 ASID 的 TLB 表项
+
+    int nice;                   // -20..19，越小分到的 CPU 时间越多
+    uint64 vruntime;            // 按权重折算的累计运行时间，调度器先运行最小的
+    uint64 exec_start;          // 本次开始运行（或上次记账）的时间
+
+    // 由等待队列桶的锁保护
+    int onwq;                   // 是否在 chan 的等待队列上
+    struct proc *wqnext;        // 等待队列中的前后进程
+    struct proc *wqprev;
+
+    // 由就绪队列的锁保护
+    int onrq;                   // 是否在某个 hart 的就绪队列中
+    int rqidx;                  // 在就绪队列堆中的下标
     char name[16];              // 进程名称
 };
 
@@ -68,6 +100,7 @@ struct cpu {
     struct context context;     // 该CPU的上下文
     int noff;                   // 该CPU上关闭中断的嵌套深度，为0的时候就可以打开中断
     int intena;                 // 中断之前是否开启
+    uint64 asid_gen;            // 该 hart 的 TLB 对应的 ASID 代数
 };
 
 extern struct proc proc[NPROC];
\ No newline at end of file
@@ -40,6 +40,7 @@
 // sstatus相关位
 #define SSTATUS_SPP       (1L << 8)
 #define SSTATUS_SPIE      (1L << 5)
+#define SSTATUS_SUM       (1L << 18)    // S 模式可以访问 PTE_U 的页
 // S 模式中断使能
 #define SIE_SEIE (1L << 9) // external
 #define SIE_STIE (1L << 5) // timer
@@ -84,6 +85,7 @@
 #define w_sepc(x)        asm volatile("csrw sepc, %0" : : "r" (x))
 #define r_scause()       ({ uint64 x; asm volatile("csrr %0, scause" : "=r" (x)); x; })
 #define r_stval()        ({ uint64 x; asm volatile("csrr %0, stval" : "=r" (x)); x; })
+#define w_sscratch(x)    asm volatile("csrw sscratch, %0" : : "r" (x))
 #define r_satp()         ({ uint64 x; asm volatile("csrr %0, satp" : "=r" (x)); x; })
 #define w_satp(x)        asm volatile("csrw satp, %0" : : "r" (x))
 #define r_sie()          ({ uint64 x; asm volatile("csrr %0, sie" : "=r" (x)); x; })
@@ -141,6 +143,8 @@ w_pmpaddr0(uint64 x)
 #define SATP_SV39 (8L << 60)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK  (0xFFFFL << SATP_ASID_SHIFT)  // satp 中的 ASID 字段
 
 
 // Machine-mode Counter-Enable
@@ -158,6 +162,34 @@ r_mcounteren()
   return x;
 }
 
+// 刷新整个 TLB
+static inline void
+sfence_vma()
+{
+  asm volatile("sfence.vma zero, zero");
+}
+
+// 只刷新 va 所在页的 TLB 表项
+static inline void
+sfence_vma_addr(uint64 va)
+{
+  asm volatile("sfence.vma %0, zero" : : "r" (va));
+}
+
+// 只刷新属于 asid 的非全局 TLB 表项
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
+// 只刷新属于 asid 的 va 所在页的 TLB 表项
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
 static inline void
 intr_on()
 {
@@ -208,15 +240,23 @@ typedef uint64 *pagetable_t;
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4)
+#define PTE_A (1L << 6) // 访问过
+#define PTE_D (1L << 7) // 写过（脏页）
+#define PTE_COW (1L << 8) // RSW 位，软件使用：写时复制的共享页
+#define PTE_SWAP (1L << 9) // RSW 位，只用在 V=0 的项中：页已换出，PPN 位置存放交换槽号
 
 #define PA2PTE(pa) ((((uint64)(pa)) >> 12) << 10)   // 物理地址转为页表项格式
 #define PTE2PA(pte) (((pte) >> 10) << 12)           // 页表项格式转为物理地址
+#define SLOT2PTE(slot) (((uint64)(slot)) << 10)     // 交换槽号放进换出项
+#define PTE2SLOT(pte) ((pte) >> 10)
 
 #define PTE_FLAGS(pte)  ((pte) & 0x3ff)           // 获取页表项的权限标志
+#define PTE_LEAF(pte)   ((pte) & (PTE_R|PTE_W|PTE_X)) // R/W/X 任一置位即为叶子页表项
 
 #define PXMASK          0x1FF // 9 bits掩码
 #define PXSHIFT(level)  (PGSHIFT+(9*(level))) // 对应每一级的VPN起始位偏移（L0=12，L1=21，L2=30）
 #define PX(level, va) ((((uint64) (va)) >> PXSHIFT(level)) & PXMASK) 
+#define LEVELSIZE(level) (1UL << PXSHIFT(level)) // 该级叶子映射的大小（4KB / 2MB / 1GB）
 
 // 虚拟内存最大地址，实际上用38位，定义了39位
 #define MAXVA (1L << (9 + 9 + 9 + 12 - 1))
\ No newline at end of file
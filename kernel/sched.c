@@ -0,0 +1,330 @@
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+
+//
+// 每个 hart 一个就绪队列，保存 RUNNABLE 的进程。
+// 进程变为 RUNNABLE 时由 setrunnable() 放入队列，scheduler() 从本 hart 的队列中取出，
+// 选下一个进程的开销与进程总数无关，空闲的 hart 也不会反复获取每个进程的锁。
+//
+// 队列按虚拟运行时间（vruntime）组织成最小堆，总是先运行 vruntime 最小的进程。
+// 进程运行 delta 时间，vruntime 增加 delta * NICE0_WEIGHT / weight，
+// weight 由 nice 值查表得到，nice 每差 1 得到的 CPU 时间大约差 10%。
+// 睡眠的进程 vruntime 不增长，醒来时不早于队列的 min_vruntime 减去一点补偿，
+// 所以交互式的进程醒来后很快就能运行，但不能靠长时间睡眠攒下时间独占 CPU。
+//
+// 负载均衡靠工作窃取：空闲的 hart 在 wfi 之前从最长的队列中偷一个进程，
+// 每个 hart 的时钟中断每隔 BALANCE_TICKS 次检查一次，比最长的队列短得多时拉一个过来。
+// 挑选被挪走的进程时优先选上一次就在本 hart 上运行的，它的数据可能还在本地 cache 中。
+//
+// 锁的顺序：先 p->lock，再队列的锁；任何时候最多只持有一个队列的锁。
+// 进程在队列中时状态一定是 RUNNABLE，
+// 取出后要重新持有 p->lock 检查状态。
+//
+
+struct runq {
+    struct spinlock lock;
+    struct proc *heap[NPROC];   // 按 vruntime 排列的最小堆
+    volatile int n;             // 队列中的进程数，空闲检查时不加锁读取
+    uint64 min_vruntime;        // 单调增长，新加入的进程以它为基准
+    int ticks;                  // 距上次均衡的时钟中断次数，只由本 hart 访问
+} __attribute__((aligned(64)));   // 各 hart 的队列放在不同的 cache line
+
+static struct runq runq[NCPU];
+
+#define BALANCE_TICKS 4     // 每个 hart 每隔几次时钟中断做一次均衡
+#define BALANCE_DIFF  2     // 队列长度至少相差这么多才挪动
+
+#define NICE0_WEIGHT  1024
+#define WAKEUP_BONUS  500000    // 醒来的进程最多领先 min_vruntime 这么多（半个时钟中断）
+
+// nice -20..19 对应的权重，相邻两级相差约 1.25 倍
+static const int nice_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+// vruntime 可能回绕，用差值的符号比较
+#define VLESS(a, b) ((long)((a) - (b)) < 0)
+
+void
+rqinit(void)
+{
+    for(int i = 0; i < NCPU; i++)
+        initlock(&runq[i].lock, "runq");
+}
+
+static void
+heap_set(struct runq *rq, int i, struct proc *p)
+{
+    rq->heap[i] = p;
+    p->rqidx = i;
+}
+
+// 位置 i 上的进程向上移动到合适的位置
+static void
+heap_up(struct runq *rq, int i)
+{
+    struct proc *p = rq->heap[i];
+
+    while(i > 0) {
+        int parent = (i - 1) / 2;
+        if(!VLESS(p->vruntime, rq->heap[parent]->vruntime))
+            break;
+        heap_set(rq, i, rq->heap[parent]);
+        i = parent;
+    }
+    heap_set(rq, i, p);
+}
+
+// 位置 i 上的进程向下移动到合适的位置
+static void
+heap_down(struct runq *rq, int i)
+{
+    struct proc *p = rq->heap[i];
+
+    for(;;) {
+        int c = 2*i + 1;
+        if(c >= rq->n)
+            break;
+        if(c + 1 < rq->n && VLESS(rq->heap[c+1]->vruntime, rq->heap[c]->vruntime))
+            c++;
+        if(!VLESS(rq->heap[c]->vruntime, p->vruntime))
+            break;
+        heap_set(rq, i, rq->heap[c]);
+        i = c;
+    }
+    heap_set(rq, i, p);
+}
+
+// 从堆中删除位置 i 上的进程，调用者持有队列的锁
+static struct proc*
+heap_remove(struct runq *rq, int i)
+{
+    struct proc *p = rq->heap[i];
+    struct proc *last;
+
+    rq->n--;
+    if(i < rq->n) {
+        // 用最后一个填补空位，再上下调整到合适的位置
+        last = rq->heap[rq->n];
+        heap_set(rq, i, last);
+        heap_down(rq, i);
+        heap_up(rq, last->rqidx);
+    }
+    rq->heap[rq->n] = 0;
+    p->onrq = 0;
+    p->rqidx = -1;
+    return p;
+}
+
+// 把 p 放入 cpu 的就绪队列，已经在某个队列中时什么也不做
+// 调用者持有 p->lock，或者 p 刚由 rq_take() 摘下
+static void
+rq_add(struct proc *p, int cpu)
+{
+    struct runq *rq = &runq[cpu];
+
+    acquire(&rq->lock);
+    if(!p->onrq) {
+        // 睡了很久或者从别的 hart 挪过来的进程，vruntime 拉到本队列的基准附近
+        if(VLESS(p->vruntime, rq->min_vruntime - WAKEUP_BONUS))
+            p->vruntime = rq->min_vruntime - WAKEUP_BONUS;
+        p->onrq = 1;
+        heap_set(rq, rq->n++, p);
+        heap_up(rq, p->rqidx);
+    }
+    release(&rq->lock);
+}
+
+// 把 p 置为 RUNNABLE 并放入就绪队列，调用者持有 p->lock
+// 放回它上一次运行的 hart，那里的 cache 和 TLB 中可能还有它的数据；
+// 从没运行过的进程放在当前 hart 上
+void
+setrunnable(struct proc *p)
+{
+    int cpu = p->lastcpu;
+
+    if(cpu < 0 || cpu >= ncpu)
+        cpu = cpuid();
+    p->state = RUNNABLE;
+    rq_add(p, cpu);
+}
+
+// 把正在运行的进程 p 从上次记账到现在的运行时间计入 vruntime
+// 在 p 放回就绪队列或者睡眠之前调用，调用者持有 p->lock
+void
+sched_charge(struct proc *p)
+{
+    uint64 now = r_time();
+
+    p->vruntime += (now - p->exec_start) * NICE0_WEIGHT / nice_weight[p->nice + 20];
+    p->exec_start = now;
+}
+
+// 取出的进程马上就要在本 hart 上运行：持有它的锁，检查状态并开始记账
+// 状态不对时返回 0
+static struct proc*
+rq_claim(struct proc *p)
+{
+    // p 可能刚在别的 hart 上 yield()，要等那边的调度器放开它的锁
+    acquire(&p->lock);
+    if(p->state != RUNNABLE) {
+        release(&p->lock);
+        return 0;
+    }
+    p->exec_start = r_time();
+    return p;
+}
+
+// 取出本 hart 就绪队列中 vruntime 最小的进程，返回时持有它的 p->lock；队列为空时返回 0
+// 调用者已关闭中断
+struct proc*
+rq_pop(void)
+{
+    struct runq *rq = &runq[cpuid()];
+    struct proc *p;
+
+    while(rq->n > 0) {
+        p = 0;
+        acquire(&rq->lock);
+        if(rq->n > 0) {
+            p = heap_remove(rq, 0);
+            if(VLESS(rq->min_vruntime, p->vruntime))
+                rq->min_vruntime = p->vruntime;
+        }
+        release(&rq->lock);
+        if(p == 0)
+            break;
+        if(rq_claim(p))
+            return p;
+    }
+    return 0;
+}
+
+// 返回除 self 之外进程最多的队列，所有队列都为空时返回 -1
+// 不加锁读取长度，只作为挑选的依据
+static int
+rq_busiest(int self)
+{
+    int best = -1, bestn = 0;
+
+    for(int i = 0; i < ncpu; i++) {
+        if(i != self && runq[i].n > bestn) {
+            best = i;
+            bestn = runq[i].n;
+        }
+    }
+    return best;
+}
+
+// 从 from 的队列中摘下一个进程给 cpu，优先选上一次在 cpu 上运行的，
+// 否则取 vruntime 最小的
+// 摘下的进程不在任何队列中，没有 hart 在运行它，也就不会被别人修改
+static struct proc*
+rq_take(int from, int cpu)
+{
+    struct runq *rq = &runq[from];
+    struct proc *p = 0;
+    int i;
+
+    acquire(&rq->lock);
+    if(rq->n > 0) {
+        for(i = 0; i < rq->n && rq->heap[i]->lastcpu != cpu; i++)
+            ;
+        p = heap_remove(rq, i < rq->n ? i : 0);
+    }
+    release(&rq->lock);
+    return p;
+}
+
+// 本 hart 空闲时从最长的队列中偷一个进程，返回时持有它的 p->lock；没有可偷的返回 0
+// 调用者已关闭中断
+struct proc*
+rq_steal(void)
+{
+    int self = cpuid();
+    int victim;
+    struct proc *p;
+
+    while((victim = rq_busiest(self)) >= 0) {
+        if((p = rq_take(victim, self)) == 0)
+            continue;       // 刚被别的 hart 取走了，重新挑选
+        if(rq_claim(p))
+            return p;
+    }
+    return 0;
+}
+
+// 由每个 hart 的时钟中断调用，定期把最长队列中的一个进程拉到本 hart
+void
+sched_balance(void)
+{
+    int self = cpuid();
+    struct runq *rq = &runq[self];
+    struct proc *p;
+    int victim;
+
+    if(++rq->ticks < BALANCE_TICKS)
+        return;
+    rq->ticks = 0;
+    if((victim = rq_busiest(self)) < 0 || runq[victim].n - rq->n < BALANCE_DIFF)
+        return;
+    if((p = rq_take(victim, self)) != 0)
+        rq_add(p, self);
+}
+
+// 设置进程 pid（0 表示自己）的 nice 值，超出 [-20, 19] 的部分截断
+// 已经积累的 vruntime 不变，之后的运行时间按新的权重计入
+int
+setnice(int pid, int nice)
+{
+    struct proc *p;
+
+    if(nice < -20)
+        nice = -20;
+    if(nice > 19)
+        nice = 19;
+    if(pid == 0)
+        pid = myproc()->pid;
+    for(p = proc; p < &proc[NPROC]; p++) {
+        acquire(&p->lock);
+        if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE) {
+            p->nice = nice;
+            release(&p->lock);
+            return 0;
+        }
+        release(&p->lock);
+    }
+    return -1;
+}
+
+// 把进程 pid（0 表示自己）的 nice 值存入 *nice，找不到时返回 -1
+int
+getnice(int pid, int *nice)
+{
+    struct proc *p;
+
+    if(pid == 0)
+        pid = myproc()->pid;
+    for(p = proc; p < &proc[NPROC]; p++) {
+        acquire(&p->lock);
+        if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE) {
+            *nice = p->nice;
+            release(&p->lock);
+            return 0;
+        }
+        release(&p->lock);
+    }
+    return -1;
+}
@@ -0,0 +1,208 @@
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "page.h"
+#include "mman.h"
+
+//
+// 共享内存段：按 key 创建，shmat 把同一组物理页映射进调用进程的页表，
+// 进程之间交换数据不需要内核复制。
+// 每个挂接的页表对每个物理页持有一个引用，段本身再持有一个，
+// 最后一个进程 shmdt（或退出）时段被销毁，物理页随引用计数归零而释放。
+// 从来没有挂接过的段由 shmrm 销毁；还有挂接时 shmrm 只让它不能再被找到和挂接。
+// 挂接的区域作为 MAP_SHARED 的 vma 记录，fork 时子进程自动挂接。
+//
+
+#define SHMMAXPAGES (PGSIZE / sizeof(void*))   // 每段最多的页数（2MB）
+
+struct shmseg {
+    int used;
+    int key;
+    int npages;
+    int nattach;        // 挂接的次数
+    int removed;        // 已经 shmrm，等最后一次挂接解除
+    void **pages;       // 各物理页的地址，本身占一页
+};
+
+static struct {
+    struct spinlock lock;
+    struct shmseg segs[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+    initlock(&shm.lock, "shm");
+}
+
+// 释放段持有的物理页，调用者持有 shm.lock
+static void
+shm_free(struct shmseg *seg)
+{
+    for(int i = 0; i < seg->npages; i++)
+        if(seg->pages[i])
+            kfree(seg->pages[i]);
+    kfree(seg->pages);
+    seg->pages = 0;
+    seg->used = 0;
+}
+
+// shmget(key, size)：返回 key 对应的段号，不存在时创建一个 size 字节的段
+uint64
+sys_shmget(void)
+{
+    int key, id;
+    uint64 size;
+    struct shmseg *seg = 0;
+
+    argint(0, &key);
+    argaddr(1, &size);
+    uint64 npages = PGROUNDUP(size) / PGSIZE;
+    if(npages == 0 || npages > SHMMAXPAGES)
+        return -1;
+
+    acquire(&shm.lock);
+    for(id = 0; id < NSHM; id++) {
+        if(shm.segs[id].used && !shm.segs[id].removed && shm.segs[id].key == key) {
+            id = shm.segs[id].npages >= npages ? id : -1;
+            release(&shm.lock);
+            return id;
+        }
+    }
+    for(id = 0; id < NSHM; id++) {
+        if(!shm.segs[id].used) {
+            seg = &shm.segs[id];
+            break;
+        }
+    }
+    if(seg == 0 || (seg->pages = kalloc_zeroed()) == 0) {
+        release(&shm.lock);
+        return -1;
+    }
+    seg->used = 1;
+    seg->key = key;
+    seg->npages = npages;
+    seg->nattach = 0;
+    seg->removed = 0;
+    for(int i = 0; i < npages; i++) {
+        if((seg->pages[i] = kalloc_zeroed()) == 0) {
+            shm_free(seg);
+            release(&shm.lock);
+            return -1;
+        }
+        kpage_settype(seg->pages[i], PG_USER);
+    }
+    release(&shm.lock);
+    return id;
+}
+
+// shmat(id)：把段映射进当前进程，返回映射的起始地址
+uint64
+sys_shmat(void)
+{
+    int id;
+    struct proc *p = myproc();
+    struct shmseg *seg;
+    struct vma *v;
+
+    argint(0, &id);
+    if(id < 0 || id >= NSHM)
+        return -1;
+    seg = &shm.segs[id];
+
+    acquire(&shm.lock);
+    if(!seg->used || seg->removed) {
+        release(&shm.lock);
+        return -1;
+    }
+    seg->nattach++;
+    release(&shm.lock);
+
+    if((v = vma_alloc(p, (uint64)seg->npages * PGSIZE)) == 0) {
+        shm_detach(seg);
+        return -1;
+    }
+    v->prot = PROT_READ | PROT_WRITE;
+    v->flags = MAP_SHARED;
+    v->shm = seg;
+
+    // 一次映射全部页面，以后访问不会缺页
+    uvm_lock(p);
+    for(int i = 0; i < seg->npages; i++) {
+        void *pa = seg->pages[i];
+        if(map_page(p->pagetable, v->start + (uint64)i * PGSIZE, (uint64)pa,
+                    PTE_R | PTE_W | PTE_U | PTE_A | PTE_D) != 0) {
+            munmap(p, v->start, v->len);   // 同时解除挂接
+            uvm_unlock(p);
+            return -1;
+        }
+        kpage_ref(pa);
+    }
+    uvm_unlock(p);
+    return v->start;
+}
+
+// shmdt(addr)：解除包含 addr 的挂接
+// munmap 可能已经去掉了区域的开头，所以不要求 addr 是区域的起点
+uint64
+sys_shmdt(void)
+{
+    uint64 addr;
+    struct proc *p = myproc();
+
+    argaddr(0, &addr);
+    for(int i = 0; i < NVMA; i++) {
+        struct vma *v = &p->vmas[i];
+        if(v->used && v->shm && v->start <= addr && addr < v->start + v->len)
+            return munmap(p, v->start, v->len);
+    }
+    return -1;
+}
+
+// shmrm(id)：销毁段。没有挂接时立即释放，否则等最后一次挂接解除，
+// 在此之前 shmget 找不到它，也不能再 shmat
+uint64
+sys_shmrm(void)
+{
+    int id;
+    struct shmseg *seg;
+
+    argint(0, &id);
+    if(id < 0 || id >= NSHM)
+        return -1;
+    seg = &shm.segs[id];
+
+    acquire(&shm.lock);
+    if(!seg->used || seg->removed) {
+        release(&shm.lock);
+        return -1;
+    }
+    seg->removed = 1;
+    if(seg->nattach == 0)
+        shm_free(seg);
+    release(&shm.lock);
+    return 0;
+}
+
+// fork 时子进程继承挂接
+void
+shm_dup(struct shmseg *seg)
+{
+    acquire(&shm.lock);
+    seg->nattach++;
+    release(&shm.lock);
+}
+
+// 解除一次挂接，最后一次挂接解除时销毁段
+void
+shm_detach(struct shmseg *seg)
+{
+    acquire(&shm.lock);
+    if(--seg->nattach == 0)
+        shm_free(seg);
+    release(&shm.lock);
+}
@@ -0,0 +1,223 @@
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "printf.h"
+#include "page.h"
+
+/**
+ * 小对象的 slab 分配器
+ *
+ * 每个 kmem_cache 管理一种固定大小的对象。对象从 slab 中切分，
+ * 一个 slab 就是一个物理页：页首是 struct slab 头，后面紧跟若干对象。
+ * 每个对象后面附带一个指针大小的链接字段，用于串起 slab 内的空闲对象，
+ * 这样空闲对象本身的内容不会被破坏，构造函数只需要在 slab 创建时调用一次，
+ * 使用者释放对象时必须把它恢复到构造后的状态。
+ *
+ * 每个 hart 在 cache 前面有一个小的对象缓存，快速路径不需要获取 cache->lock。
+ */
+
+#define NSLABCACHE      16  // 系统中 cache 的最大数量
+#define SLAB_CPU_LIMIT  16  // 每个 hart 缓存的对象上限
+#define SLAB_CPU_BATCH   8  // 每个 hart 与 slab 之间一次交换的对象数
+
+struct slab {
+    struct slab *next;          // partial 链表
+    struct slab *prev;
+    struct kmem_cache *cache;   // 所属的 cache
+    void *freelist;             // slab 内空闲对象链表
+    int inuse;                  // 已分配（含 hart 缓存中）的对象数
+    int onlist;                 // 是否在 partial 链表上
+};
+
+struct kmem_cpu_cache {
+    int avail;                  // objs 中可用对象的个数
+    void *objs[SLAB_CPU_LIMIT];
+} __attribute__((aligned(64)));
+
+struct kmem_cache {
+    struct spinlock lock;
+    char *name;
+    uint size;                  // 对象大小
+    uint stride;                // 对象占用的空间（对象 + 链接字段）
+    int perslab;                // 每个 slab 中的对象数
+    void (*ctor)(void *);       // 构造函数，可以为 0
+    struct slab *partial;       // 还有空闲对象的 slab
+    int nslabs;                 // 当前持有的 slab 页数
+    struct kmem_cpu_cache cpu[NCPU];
+};
+
+static struct kmem_cache caches[NSLABCACHE];
+static int ncaches;
+
+#define SLAB_HDRSIZE  ((sizeof(struct slab) + 7) & ~7UL)
+#define OBJ_LINK(c, obj)  (*(void**)((char*)(obj) + (c)->stride - sizeof(void*)))
+#define OBJ2SLAB(obj) ((struct slab*)PGROUNDDOWN((uint64)(obj)))
+
+// 创建一个对象 cache，只能在初始化阶段调用
+struct kmem_cache*
+kmem_cache_create(char *name, uint size, void (*ctor)(void *))
+{
+    struct kmem_cache *c;
+
+    if(ncaches >= NSLABCACHE)
+        panic("kmem_cache_create: too many caches");
+    c = &caches[ncaches++];
+    initlock(&c->lock, "kmem_cache");
+    c->name = name;
+    c->size = size;
+    c->stride = ((size + 7) & ~7U) + sizeof(void*);
+    c->perslab = (PGSIZE - SLAB_HDRSIZE) / c->stride;
+    if(c->perslab < 1)
+        panic("kmem_cache_create: object too large");
+    c->ctor = ctor;
+    c->partial = 0;
+    c->nslabs = 0;
+    return c;
+}
+
+static void
+slab_link(struct kmem_cache *c, struct slab *s)
+{
+    s->prev = 0;
+    s->next = c->partial;
+    if(s->next)
+        s->next->prev = s;
+    c->partial = s;
+    s->onlist = 1;
+}
+
+static void
+slab_unlink(struct kmem_cache *c, struct slab *s)
+{
+    if(s->prev)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+    if(s->next)
+        s->next->prev = s->prev;
+    s->onlist = 0;
+}
+
+// 分配一个新的 slab 页并构造其中的所有对象，调用者持有 c->lock
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+    struct slab *s;
+    char *obj;
+
+    if((s = (struct slab*)kalloc()) == 0)
+        return 0;
+    kpage_settype(s, PG_SLAB);
+    s->cache = c;
+    s->inuse = 0;
+    s->freelist = 0;
+    // 倒序串起来，这样分配时按地址递增
+    for(int i = c->perslab - 1; i >= 0; i--) {
+        obj = (char*)s + SLAB_HDRSIZE + i * c->stride;
+        if(c->ctor)
+            c->ctor(obj);
+        OBJ_LINK(c, obj) = s->freelist;
+        s->freelist = obj;
+    }
+    slab_link(c, s);
+    c->nslabs++;
+    return s;
+}
+
+// 从 slab 中取最多 n 个对象放入 objs，返回实际个数，调用者持有 c->lock
+static int
+slab_take(struct kmem_cache *c, void **objs, int n)
+{
+    struct slab *s;
+    int got = 0;
+
+    while(got < n) {
+        if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+            break;
+        while(got < n && s->freelist) {
+            void *obj = s->freelist;
+            s->freelist = OBJ_LINK(c, obj);
+            s->inuse++;
+            objs[got++] = obj;
+        }
+        if(s->freelist == 0)
+            slab_unlink(c, s);
+    }
+    return got;
+}
+
+// 把对象还给所属的 slab，slab 完全空闲且还有别的 partial slab 时释放该页，调用者持有 c->lock
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+    struct slab *s = OBJ2SLAB(obj);
+
+    if(s->cache != c)
+        panic("kmem_cache_free: wrong cache");
+    OBJ_LINK(c, obj) = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    if(!s->onlist)
+        slab_link(c, s);
+    if(s->inuse == 0 && (s->next || s->prev)) {
+        slab_unlink(c, s);
+        c->nslabs--;
+        kfree(s);
+    }
+}
+
+// 分配一个对象，返回的对象处于构造后的状态
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct kmem_cpu_cache *cc;
+    void *obj = 0;
+
+    push_off();
+    cc = &c->cpu[cpuid()];
+    if(cc->avail == 0) {
+        acquire(&c->lock);
+        cc->avail = slab_take(c, cc->objs, SLAB_CPU_BATCH);
+        release(&c->lock);
+    }
+    if(cc->avail > 0)
+        obj = cc->objs[--cc->avail];
+    pop_off();
+    return obj;
+}
+
+// 释放一个对象，调用者必须保证对象已恢复到构造后的状态
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct kmem_cpu_cache *cc;
+
+    push_off();
+    cc = &c->cpu[cpuid()];
+    if(cc->avail == SLAB_CPU_LIMIT) {
+        // 本 hart 缓存已满，把较早放入的一半还给 slab
+        acquire(&c->lock);
+        for(int i = 0; i < SLAB_CPU_BATCH; i++)
+            slab_put(c, cc->objs[i]);
+        release(&c->lock);
+        for(int i = SLAB_CPU_BATCH; i < SLAB_CPU_LIMIT; i++)
+            cc->objs[i - SLAB_CPU_BATCH] = cc->objs[i];
+        cc->avail -= SLAB_CPU_BATCH;
+    }
+    cc->objs[cc->avail++] = obj;
+    pop_off();
+}
+
+// 打印各 cache 的使用情况，用于调试
+void
+kmem_cache_dump(void)
+{
+    for(int i = 0; i < ncaches; i++) {
+        struct kmem_cache *c = &caches[i];
+        printf("%s: size=%d perslab=%d slabs=%d\n",
+               c->name, c->size, c->perslab, c->nslabs);
+    }
+}
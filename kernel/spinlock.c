@@ -46,15 +46,14 @@ release(struct spinlock *lk)
     pop_off(); // 恢复中断
 }
 
+// 当前 hart 是否持有锁 lk，调用者必须已经关闭中断
 int
 holding(struct spinlock *lk)
 {
     int re;
-    // 原来的实现，考虑当前运行的cpu是否正确 re = (lk->locked && lk->cpu == mycpu());
-    // 现在简化多核运行环境，单核环境下只需要判断是否加锁
-    re = (lk->locked != 0);
+    // 多核时别的 hart 持有锁不算，否则 acquire() 会误报死锁
+    re = (lk->locked && lk->cpu == mycpu());
     return re;
-
 }
 
 void
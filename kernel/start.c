@@ -6,7 +6,10 @@ extern void uart_puts(const char *s);
 extern void main();
 void timerinit();
 
-void start() {
+uint64 dtb_pa;  // QEMU 传入的设备树物理地址，由 main() 交给 fdtinit() 解析
+
+void start(uint64 hartid, uint64 dtb) {
+  dtb_pa = dtb;
 
   // 设置 M 前一特权模式为管理模式（Supervisor），用于 mret 指令返回后进入管理模式。
   unsigned long x = r_mstatus();  // 读取mstatus寄存器的值
@@ -2,6 +2,22 @@
 
 void *memset(void *dst, int c, unsigned long n) {
     unsigned char *p = dst;
+
+    // 先按字节写到 8 字节对齐，中间按 8 字节整字写，最后处理剩余字节
+    while (n > 0 && ((uint64)p & 7)) {
+        *p++ = c;
+        n--;
+    }
+    if (n >= 8) {
+        uint64 v = (uchar)c;
+        v |= v << 8;
+        v |= v << 16;
+        v |= v << 32;
+        uint64 *w = (uint64 *)p;
+        for (; n >= 8; n -= 8)
+            *w++ = v;
+        p = (unsigned char *)w;
+    }
     while (n-- > 0) *p++ = c;
     return dst;
 }
@@ -9,6 +25,20 @@ void *memset(void *dst, int c, unsigned long n) {
 void *memcpy(void *dst, const void *src, unsigned long n) {
     unsigned char *d = dst;
     const unsigned char *s = src;
+
+    // 源和目的对 8 取模相同时，先按字节对齐，中间按 8 字节整字复制
+    if ((((uint64)d ^ (uint64)s) & 7) == 0) {
+        while (n > 0 && ((uint64)d & 7)) {
+            *d++ = *s++;
+            n--;
+        }
+        uint64 *dw = (uint64 *)d;
+        const uint64 *sw = (const uint64 *)s;
+        for (; n >= 8; n -= 8)
+            *dw++ = *sw++;
+        d = (unsigned char *)dw;
+        s = (const unsigned char *)sw;
+    }
     while (n-- > 0) *d++ = *s++;
     return dst;
 }
@@ -25,13 +55,24 @@ memmove(void *dst, const void *src, uint n)
   s = src;
   d = dst;
   if(s < d && s + n > d){
+    // 目的在源之后且重叠，只能从后往前复制
     s += n;
     d += n;
+    if((((uint64)d ^ (uint64)s) & 7) == 0){
+      while(n > 0 && ((uint64)d & 7)){
+        *--d = *--s;
+        n--;
+      }
+      for(; n >= 8; n -= 8){
+        d -= 8;
+        s -= 8;
+        *(uint64*)d = *(const uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
   } else
-    while(n-- > 0)
-      *d++ = *s++;
+    memcpy(d, s, n);   // 从前往后复制在 d < s 时也是安全的
 
   return dst;
 }
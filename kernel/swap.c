@@ -0,0 +1,298 @@
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "page.h"
+#include "printf.h"
+#include "swap.h"
+
+//
+// 换页：内存不足时把用户页写到磁盘上文件系统之后的交换区，腾出物理页。
+// 换出的页在 PTE 中留下换出项（V=0、PTE_SWAP、原来的权限位和槽号），
+// 下次访问时由缺页处理调用 swap_in() 读回来。
+//
+// 回收用时钟（二次机会）算法，按进程、按地址依次扫描各进程的堆：
+// PTE_A 置位的页清掉 A 位再给一次机会，A 位为 0 的页被回收。
+// 其中 D 位为 0 的页从缺页分配以来没有写过，内容仍然全是 0，
+// 直接丢弃，下次访问时重新分配清零的页，不需要写盘。
+// 写盘是异步的：一批页依次提交给 virtio，扫描结束后再统一等待完成、释放物理页。
+// 换出项在持有 p->lock 时写好，写盘请求在放开 p->lock 之后才提交。
+// 只回收只被一个页表引用的 4KB 堆页，共享页、大页和 mmap 区域都跳过。
+//
+// 修改别的进程的页表时持有它的 p->lock 并且它不在运行，
+// 它下次被调度时 uvm_switch() 根据 p->tlbflush 刷新 TLB。
+//
+
+#define SWAP_BATCH   8      // 每次内存不足时回收的页数
+#define SWAP_MAXSCAN 8192   // 一次回收最多扫描的页数
+#define SWAP_TRIES   4      // 分配失败后回收再重试的次数
+
+extern struct proc proc[NPROC];
+
+static struct {
+    struct spinlock lock;
+    uchar ref[NSWAP];           // 每个槽被多少个换出项（以及进行中的写盘）引用
+    int next;                   // 下次从这里开始找空闲槽
+    struct {
+        int used;
+        int slot;
+        struct swapreq req;
+    } io[NSWAPIO];              // 进行中的换出写盘
+    int hand;                   // 时钟指针：正在扫描的进程
+    uint64 handva;              // 以及该进程中下一个要扫描的地址
+} swap;
+
+void
+swapinit(void)
+{
+    initlock(&swap.lock, "swap");
+    printf("swap: %d pages at block %d\n", NSWAP, SWAPSTART);
+}
+
+// 槽在磁盘上的起始块号
+static uint
+slot_block(int slot)
+{
+    return SWAPSTART + slot * (PGSIZE / BSIZE);
+}
+
+// 分配一个引用计数为 1 的交换槽，交换区已满时返回 -1
+static int
+slot_alloc(void)
+{
+    acquire(&swap.lock);
+    for(int i = 0; i < NSWAP; i++) {
+        int s = (swap.next + i) % NSWAP;
+        if(swap.ref[s] == 0) {
+            swap.ref[s] = 1;
+            swap.next = s + 1;
+            release(&swap.lock);
+            return s;
+        }
+    }
+    release(&swap.lock);
+    return -1;
+}
+
+// 换出项被复制（fork）时增加槽的引用
+void
+swap_dup(uint64 slot)
+{
+    acquire(&swap.lock);
+    if(slot >= NSWAP || swap.ref[slot] == 0 || swap.ref[slot] == 255)
+        panic("swap_dup");
+    swap.ref[slot]++;
+    release(&swap.lock);
+}
+
+// 去掉一个对槽的引用，减到 0 时槽可以重新分配
+void
+swap_free(uint64 slot)
+{
+    acquire(&swap.lock);
+    if(slot >= NSWAP || swap.ref[slot] == 0)
+        panic("swap_free");
+    swap.ref[slot]--;
+    release(&swap.lock);
+}
+
+// 为槽 slot 的写盘取一个空闲的请求，写盘期间请求也持有槽的一个引用
+// 都在使用中时返回 -1
+static int
+io_alloc(int slot)
+{
+    acquire(&swap.lock);
+    for(int i = 0; i < NSWAPIO; i++) {
+        if(!swap.io[i].used) {
+            swap.io[i].used = 1;
+            swap.io[i].slot = slot;
+            swap.ref[slot]++;
+            release(&swap.lock);
+            return i;
+        }
+    }
+    release(&swap.lock);
+    return -1;
+}
+
+// 槽 slot 还在写盘时等待它完成
+static void
+io_wait_slot(int slot)
+{
+    acquire(&swap.lock);
+    for(int i = 0; i < NSWAPIO; i++) {
+        if(swap.io[i].used && swap.io[i].slot == slot) {
+            struct swapreq *r = &swap.io[i].req;
+            release(&swap.lock);
+            virtio_disk_wait(r);
+            return;
+        }
+    }
+    release(&swap.lock);
+}
+
+// 时钟算法回收最多 n 页，返回回收的页数
+// 可以在持有自旋锁时调用，这时磁盘操作改为轮询
+int
+swap_reclaim(int n)
+{
+    struct proc *me = myproc();
+    int ios[NSWAPIO], nio = 0, submitted = 0;
+    int freed = 0, scanned = 0, stop = 0;
+
+    while(freed < n && scanned < SWAP_MAXSCAN && !stop) {
+        acquire(&swap.lock);
+        struct proc *p = &proc[swap.hand];
+        uint64 va = swap.handva;
+        release(&swap.lock);
+
+        int changed = 0;
+        int locked = 0;
+        int skip = holding(&p->lock);   // 比如 allocproc() 中正在创建的进程
+        if(!skip) {
+            acquire(&p->lock);
+            locked = 1;
+            // 正在修改自己页表的进程（包括调用者自己）持有地址空间锁，跳过它
+            skip = p->state == UNUSED || p->state == ZOMBIE || p->pagetable == 0 ||
+                   (p->state == RUNNING && p != me) || p->vmlocked;
+        }
+        if(skip)
+            scanned++;
+
+        for(; !skip && va < p->sz && freed < n && scanned < SWAP_MAXSCAN; va += PGSIZE) {
+            pte_t *pte;
+            int level;
+
+            scanned++;
+            pte = walk_lookup_level(p->pagetable, va, &level);
+            if(pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) || level != 0)
+                continue;
+            // 写时复制的页即使只剩一个引用也跳过，uvmcow() 可能正在为它分配新页
+            uint64 pa = PTE2PA(*pte);
+            if((*pte & PTE_COW) || kpage_refcnt((void*)pa) != 1)
+                continue;
+            if(*pte & PTE_A) {
+                *pte &= ~PTE_A;     // 最近访问过，再给一次机会
+                changed = 1;
+                continue;
+            }
+            if((*pte & PTE_D) == 0) {
+                // 没有写过的清零页，直接丢弃
+                *pte = 0;
+                changed = 1;
+                kfree((void*)pa);
+                freed++;
+                continue;
+            }
+
+            int slot = slot_alloc();
+            if(slot < 0) {
+                stop = 1;           // 交换区已满
+                break;
+            }
+            int io = io_alloc(slot);
+            if(io < 0) {
+                swap_free(slot);
+                stop = 1;           // 写盘请求都在使用中，先等这一批完成
+                break;
+            }
+            *pte = PTE_SWAP | SLOT2PTE(slot) | (PTE_FLAGS(*pte) & (PTE_R | PTE_W | PTE_X | PTE_U | PTE_COW));
+            changed = 1;
+            swap.io[io].req.pa = (void*)pa;
+            swap.io[io].req.blockno = slot_block(slot);
+            swap.io[io].req.write = 1;
+            // 放开 p->lock 之后才提交，在此之前换入这一页的进程也要等待
+            swap.io[io].req.busy = 1;
+            ios[nio++] = io;
+            freed++;
+        }
+
+        if(changed) {
+            if(p == me)
+                uvm_changed(p->pagetable, MAXVA);
+            else
+                p->tlbflush = 1;
+        }
+        int done = skip || va >= p->sz;
+        if(locked)
+            release(&p->lock);
+
+        // 提交这个进程的写盘。磁盘描述符不够时 disk_wait() 可能轮询完成队列并唤醒睡眠的进程，
+        // 其中可能就有 p，所以不能在持有 p->lock 时提交
+        for(; submitted < nio; submitted++)
+            virtio_disk_page(&swap.io[ios[submitted]].req);
+
+        // 移动时钟指针
+        acquire(&swap.lock);
+        if(done) {
+            swap.hand = (swap.hand + 1) % NPROC;
+            swap.handva = 0;
+        } else {
+            swap.handva = va;
+        }
+        release(&swap.lock);
+    }
+
+    // 写盘完成后才能释放物理页
+    for(int i = 0; i < nio; i++) {
+        struct swapreq *r = &swap.io[ios[i]].req;
+        virtio_disk_wait(r);
+        kfree(r->pa);
+        acquire(&swap.lock);
+        swap.ref[swap.io[ios[i]].slot]--;
+        swap.io[ios[i]].used = 0;
+        release(&swap.lock);
+    }
+    return freed;
+}
+
+// 为用户内存分配一页（zero 非 0 时清零），内存不足时先回收再重试
+void *
+swap_kalloc(int zero)
+{
+    void *mem = 0;
+
+    for(int i = 0; i < SWAP_TRIES; i++) {
+        mem = zero ? kalloc_zeroed() : kalloc();
+        if(mem || swap_reclaim(SWAP_BATCH) == 0)
+            break;
+    }
+    return mem;
+}
+
+// 把换出项 *pte 对应的页读回来，重新映射到 va，返回物理页地址，失败返回 0
+uint64
+swap_in(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+    pte_t old = *pte;
+    int slot = PTE2SLOT(old);
+    struct swapreq r;
+    char *mem;
+
+    if((mem = swap_kalloc(0)) == 0)
+        return 0;
+    kpage_settype(mem, PG_USER);
+
+    // 可能刚被换出，写盘还没有结束
+    io_wait_slot(slot);
+    r.pa = mem;
+    r.blockno = slot_block(slot);
+    r.write = 0;
+    r.busy = 0;
+    virtio_disk_page(&r);
+    virtio_disk_wait(&r);
+
+    if(*pte != old) {
+        kfree(mem);
+        return 0;
+    }
+    // 读回来的内容不是全 0，置上 D 位，回收时要重新写盘
+    *pte = PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_SWAP) | PTE_V | PTE_A | PTE_D;
+    uvm_changed(pagetable, va);
+    swap_free(slot);
+    return (uint64)mem;
+}
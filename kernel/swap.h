@@ -0,0 +1,10 @@
+#pragma once
+#include "types.h"
+
+// 一次整页的磁盘读写，由 virtio_disk_page() 发起、virtio_disk_wait() 等待
+struct swapreq {
+    void *pa;           // 物理页
+    uint blockno;       // 起始块号（以 BSIZE 为单位）
+    int write;
+    volatile int busy;  // 已经提交给设备、还没有完成
+};
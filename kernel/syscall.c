@@ -88,6 +88,15 @@ extern uint64 sys_exit(void);
 extern uint64 sys_wait(void);
 extern uint64 sys_getpid(void);
 extern uint64 sys_kill(void);
+extern uint64 sys_sbrk(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_shmrm(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_getpriority(void);
 
 // 简化的系统调用表，只包含我们实现的系统调用
 static uint64 (*syscalls[])(void) = {
@@ -96,6 +105,15 @@ static uint64 (*syscalls[])(void) = {
   [SYS_wait]    sys_wait,
   [SYS_kill]    sys_kill,
   [SYS_getpid]  sys_getpid,
+  [SYS_sbrk]    sys_sbrk,
+  [SYS_mmap]    sys_mmap,
+  [SYS_munmap]  sys_munmap,
+  [SYS_shmget]  sys_shmget,
+  [SYS_shmat]   sys_shmat,
+  [SYS_shmdt]   sys_shmdt,
+  [SYS_shmrm]   sys_shmrm,
+  [SYS_setpriority] sys_setpriority,
+  [SYS_getpriority] sys_getpriority,
 };
 
 // trapframe->a7存放系统调用号，同时在系统调用执行后，需要存放返回值到a0中
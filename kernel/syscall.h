@@ -23,6 +23,14 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
-#define SYS_end    22  // 系统调用结束标志
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_shmget 24
+#define SYS_shmat  25
+#define SYS_shmdt  26
+#define SYS_setpriority 27
+#define SYS_getpriority 28
+#define SYS_shmrm  29
+#define SYS_end    30  // 系统调用结束标志
 
 #endif // __SYSCALL_H__
\ No newline at end of file
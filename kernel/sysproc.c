@@ -45,9 +45,70 @@ sys_kill(void)
     return kkill(pid);
 }
 
+/**
+ * setpriority(pid, nice)：设置进程的 nice 值（-20..19，越小优先级越高），pid 为 0 表示自己
+ * 成功返回 0，找不到进程返回 -1
+ */
+uint64
+sys_setpriority(void)
+{
+    int pid, nice;
+
+    argint(0, &pid);
+    argint(1, &nice);
+    return setnice(pid, nice);
+}
+
+/**
+ * getpriority(pid)：返回 20 - nice（1..40），和 Linux 的系统调用一样避开 -1，
+ * 找不到进程返回 -1
+ */
+uint64
+sys_getpriority(void)
+{
+    int pid, nice;
+
+    argint(0, &pid);
+    if(getnice(pid, &nice) < 0)
+        return -1;
+    return 20 - nice;
+}
+
 // 实现getpid系统调用 - 获取当前进程ID
 uint64
 sys_getpid(void)
 {
   return myproc()->pid;
 }
+
+/**
+ * 调整进程的内存大小，返回原来的大小
+ * 增长时只移动 p->sz，页在第一次访问时由缺页处理分配并清零，
+ * 缩小时立即释放多出来的页
+ */
+uint64
+sys_sbrk(void)
+{
+    int n;
+    struct proc *p = myproc();
+    uint64 addr = p->sz;
+
+    argint(0, &n);
+    if(n > 0) {
+        if(addr + n > UHEAPTOP)         // 不能长进设备映射
+            return -1;
+        p->sz += n;
+    } else if(n < 0) {
+        if((uint64)-n > addr)
+            return -1;
+        // 要拆开的大页拆不开（内存不足）时什么都没有释放
+        uvm_lock(p);
+        if(uvmdealloc(p->pagetable, addr, addr + n) != addr + n) {
+            uvm_unlock(p);
+            return -1;
+        }
+        p->sz = addr + n;
+        uvm_unlock(p);
+    }
+    return addr;
+}
@@ -211,53 +211,499 @@ void test_kwait() {
     test_exit_kwait_simulated();
 }
 
-// sleep/wakeup 测试：不能让当前进程 sleep（会导致调度器等待），
-// 所以我们直接构造一个假的进程使其处于 SLEEPING，然后调用 wakeup 验证 wakeup 把它置为 RUNNABLE。
+// sleep/wakeup 测试：当前进程不能 sleep（会导致调度器等待），
+// 所以创建一个内核线程，让它真正调用 sleep() 睡在 sw.go 上，
+// 测试确认它处于 SLEEPING 并且不在就绪队列中，再调用 wakeup() 把它放回就绪队列，
+// 线程醒来后记下结果，变成没有父进程的 ZOMBIE，由测试回收
+static struct {
+    struct spinlock lock;
+    int asleep;     // 线程已经开始等待
+    int go;         // 测试允许线程继续
+    volatile int woken;     // 线程已经被唤醒并重新运行，测试不加锁轮询
+} sw;
+
+static void
+sleep_wakeup_thread(void)
+{
+    struct proc *p = myproc();
+
+    release(&p->lock);      // 和 forkret 一样，放开调度器交过来的锁
+    acquire(&sw.lock);
+    sw.asleep = 1;
+    while(!sw.go)
+        sleep(&sw.go, &sw.lock);
+    sw.woken = 1;
+    release(&sw.lock);
+
+    acquire(&p->lock);
+    p->state = ZOMBIE;
+    sched();
+    panic("sleep_wakeup_thread");
+}
+
 void test_sleep_wakeup_simulated() {
     printf("=== sleep/wakeup simulated test ===\n");
+    initlock(&sw.lock, "sw");
+    sw.asleep = sw.go = sw.woken = 0;
+
     struct proc *p = allocproc();
     if(!p) {
         printf("allocproc for sleep/wakeup failed\n");
         return;
     }
-
-    // 把这个进程放到 SLEEPING 上，并设置 chan
-    // acquire(&p->lock);
-    p->chan = (void*)0xdead;
-    p->state = SLEEPING;
+    p->context.ra = (uint64)sleep_wakeup_thread;
+    setrunnable(p);
     release(&p->lock);
 
-    // 调用 wakeup，期望把 p->state 置为 RUNNABLE
-    wakeup((void*)0xdead);
-
-    // 检查状态
+    // 等线程睡下：sw.asleep 置位之后它在 sleep() 中放开 sw.lock，
+    // 拿到 sw.lock 时它一定已经是 SLEEPING
+    for(;;) {
+        acquire(&sw.lock);
+        if(sw.asleep)
+            break;
+        release(&sw.lock);
+    }
     acquire(&p->lock);
     int state = p->state;
+    int queued = p->onrq;
     release(&p->lock);
-
-    printf("after wakeup: pid=%d state=%d (expect RUNNABLE=%d)\n", p->pid, state, RUNNABLE);
-
-    // 清理
-    acquire(&p->lock);
-    if(p->state == RUNNABLE) {
-        // 手动回收（因为 kvfork 等未真正运行）
-        p->state = UNUSED;
-    } else {
-        // 如果仍然 SLEEPING/其他，直接 free
-        p->state = UNUSED;
+    printf("before wakeup: pid=%d state=%d onrq=%d (expect SLEEPING=%d, 0)\n",
+           p->pid, state, queued, SLEEPING);
+
+    // 唤醒后线程经 setrunnable() 进入就绪队列，被某个 hart 取出运行
+    sw.go = 1;
+    wakeup(&sw.go);
+    release(&sw.lock);
+    while(!sw.woken)
+        ;
+
+    // 线程切换回调度器之后它的锁才会被放开，这时它已经不在任何就绪队列中
+    for(;;) {
+        acquire(&p->lock);
+        if(p->state == ZOMBIE)
+            break;
+        release(&p->lock);
     }
+    printf("after wakeup: pid=%d woken=%d onrq=%d (expect 1, 0)\n", p->pid, sw.woken, p->onrq);
+    if(state != SLEEPING || queued || p->onrq)
+        printf("sleep/wakeup test FAILED\n");
+    freeproc(p);
     release(&p->lock);
 }
 
 // 统一测试入口（按顺序运行不会阻塞调度器）
 void test_entry() {
+    test_kalloc_bench();
+    test_buddy();
+    test_cow();
+    test_zero_page();
+    test_superpage();
     test_allocproc_freeproc();
     test_kfork();
     test_kwait();
     test_sleep_wakeup_simulated();
+    test_syscall_bench();
     printf("=== all tests done ===\n");
 
     initproc->state = ZOMBIE; // 让 initproc 退出，结束模拟
     acquire(&initproc->lock);
     sched();
-}
\ No newline at end of file
+}
+
+// 物理页分配器吞吐量测试：先在当前 hart 上单独跑一遍，再在所有 hart 上同时跑，
+// 各 hart 只操作自己的页缓存，总吞吐量应随 hart 数近似线性增长
+#define BENCH_BATCH  32
+#define BENCH_ROUNDS 1000
+
+static volatile int bench_ready, bench_done, bench_nharts;
+static uint64 bench_ticks[NCPU];
+static int bench_hart[NCPU];
+
+// 反复分配、释放一批页，返回用掉的时钟数
+static uint64
+kalloc_bench_loop(void)
+{
+    void *pages[BENCH_BATCH];
+    uint64 start = r_time();
+
+    for(int r = 0; r < BENCH_ROUNDS; r++) {
+        for(int i = 0; i < BENCH_BATCH; i++)
+            pages[i] = kalloc();
+        for(int i = 0; i < BENCH_BATCH; i++)
+            if(pages[i])
+                kfree(pages[i]);
+    }
+    return r_time() - start;
+}
+
+// 等所有参与的 hart 都到齐后同时开始，结果按到达的顺序记录
+static void
+kalloc_bench_run(void)
+{
+    int slot = __sync_fetch_and_add(&bench_ready, 1);
+
+    while(bench_ready < bench_nharts)
+        ;
+    bench_ticks[slot] = kalloc_bench_loop();
+    bench_hart[slot] = cpuid();
+    __sync_fetch_and_add(&bench_done, 1);
+}
+
+// 在其余 hart 上运行的内核线程，跑完后变成没有父进程的 ZOMBIE，由测试回收
+static void
+kalloc_bench_thread(void)
+{
+    struct proc *p = myproc();
+
+    release(&p->lock);      // 和 forkret 一样，放开调度器交过来的锁
+    kalloc_bench_run();
+    acquire(&p->lock);
+    p->state = ZOMBIE;
+    sched();
+    panic("kalloc_bench_thread");
+}
+
+void test_kalloc_bench(void) {
+    struct proc *workers[NCPU];
+    int n = 0;
+    uint64 single, slowest = 0;
+
+    printf("=== kalloc bench ===\n");
+    single = kalloc_bench_loop();
+    printf("1 hart: %d alloc/free pairs in %ld ticks\n", BENCH_BATCH * BENCH_ROUNDS, single);
+
+    // 每个其余的 hart 上放一个内核线程，当前 hart 自己也参与
+    bench_ready = bench_done = 0;
+    bench_nharts = 1;
+    for(int i = 0; i < ncpu; i++) {
+        if(i == cpuid())
+            continue;
+        struct proc *p = allocproc();
+        if(p == 0)
+            break;
+        p->context.ra = (uint64)kalloc_bench_thread;
+        p->lastcpu = i;
+        bench_nharts++;
+        setrunnable(p);
+        release(&p->lock);
+        workers[n++] = p;
+    }
+    kalloc_bench_run();
+    while(bench_done < bench_nharts)
+        ;
+
+    // 线程切换回调度器之后它的锁才会被放开，这时才能回收
+    for(int i = 0; i < n; i++) {
+        for(;;) {
+            acquire(&workers[i]->lock);
+            if(workers[i]->state == ZOMBIE)
+                break;
+            release(&workers[i]->lock);
+        }
+        freeproc(workers[i]);
+        release(&workers[i]->lock);
+    }
+
+    for(int i = 0; i < bench_nharts; i++) {
+        printf("hart %d: %ld ticks\n", bench_hart[i], bench_ticks[i]);
+        if(bench_ticks[i] > slowest)
+            slowest = bench_ticks[i];
+    }
+    // 总吞吐量按最慢的 hart 计算：同样的时间内所有 hart 一共完成的分配次数
+    uint64 pairs = (uint64)BENCH_BATCH * BENCH_ROUNDS;
+    printf("%d harts: %ld pairs in %ld ticks, aggregate %ld pairs per 1000 ticks (1 hart: %ld)\n",
+           bench_nharts, pairs * bench_nharts, slowest,
+           pairs * bench_nharts * 1000 / (slowest ? slowest : 1), pairs * 1000 / (single ? single : 1));
+    printf("free pages=%d\n", kfreemem());
+}
+
+// 伙伴系统测试：多页分配必须物理连续且按块大小对齐，
+// 拆分大块时每一阶留下一个同阶的空闲伙伴，释放后合并回原来的大块
+#define BLOCK_DOWN(pa, order) ((char*)((uint64)(pa) & ~(((uint64)PGSIZE << (order)) - 1)))
+#define BUDDY_OF(pa, order)   ((char*)((uint64)(pa) ^ ((uint64)PGSIZE << (order))))
+
+// 包含 pa 的空闲块的阶（不小于 min），pa 不在这样的空闲块中时返回 -1
+static int
+free_block_order(char *pa, int min)
+{
+    for(int k = min; k < 11; k++)
+        if(kbuddy_order(BLOCK_DOWN(pa, k)) == k)
+            return k;
+    return -1;
+}
+
+// 空闲的 hart 同时在补充预清零池，每个 hart 最多有一页正在清零、不计入 kfreemem()
+#define FREEMEM_NEAR(n, want) ((n) <= (want) + ncpu && (n) >= (want) - ncpu)
+
+void test_buddy(void) {
+    printf("=== buddy allocator test ===\n");
+    int before = kfreemem();
+
+    char *a = kalloc_pages(4);    // 16 页
+    char *b = kalloc_pages(9);    // 512 页 = 2MB
+    if(a == 0 || b == 0) {
+        printf("kalloc_pages failed\n");
+        return;
+    }
+    if(((uint64)a % (16 * PGSIZE)) != 0 || ((uint64)b % (512 * PGSIZE)) != 0) {
+        printf("kalloc_pages returned misaligned block: %p %p\n", a, b);
+        return;
+    }
+    if(!FREEMEM_NEAR(kfreemem(), before - 16 - 512)) {
+        printf("free count off after alloc: before=%d now=%d\n", before, kfreemem());
+        return;
+    }
+    // 整块可写，且不与另一块重叠
+    memset(a, 0xaa, 16 * PGSIZE);
+    memset(b, 0x55, 512 * PGSIZE);
+    if(a[16 * PGSIZE - 1] != (char)0xaa) {
+        printf("blocks overlap\n");
+        return;
+    }
+
+    // a 是从 split 阶的块拆出来的：4..split-1 阶各有一个同阶的空闲伙伴，
+    // 任何一阶上都没有覆盖 a 的空闲块
+    int split = 4;
+    while(split < 10 && kbuddy_order(BUDDY_OF(BLOCK_DOWN(a, split), split)) == split)
+        split++;
+    if(free_block_order(a, 0) >= 0 || free_block_order(b, 0) >= 0) {
+        printf("allocated block still inside a free block\n");
+        return;
+    }
+
+    // 释放后与拆分留下的伙伴逐级合并，回到至少 split 阶的空闲块
+    kfree_pages(a, 4);
+    if(free_block_order(a, split) < 0) {
+        printf("order-4 block did not coalesce back to order %d\n", split);
+        return;
+    }
+    kfree_pages(b, 9);
+    if(free_block_order(b, 9) < 0) {
+        printf("order-9 block not returned whole\n");
+        return;
+    }
+    if(!FREEMEM_NEAR(kfreemem(), before)) {
+        printf("free pages before=%d after=%d\n", before, kfreemem());
+        return;
+    }
+    printf("buddy allocator test passed.\n");
+}
+
+void test_cow(void) {
+    printf("=== copy-on-write test ===\n");
+    pagetable_t parent = create_pagetable();
+    pagetable_t child = create_pagetable();
+    char *pa = kalloc();
+    if(parent == 0 || child == 0 || pa == 0) {
+        printf("allocation failed\n");
+        return;
+    }
+    pa[0] = 'p';
+    map_page(parent, 0, (uint64)pa, PTE_R | PTE_W | PTE_U);
+
+    // fork 之后两边共享同一个只读页
+    if(uvmcopy(parent, child, PGSIZE) != 0) {
+        printf("uvmcopy failed\n");
+        return;
+    }
+    pte_t *ppte = walk_lookup(parent, 0);
+    pte_t *cpte = walk_lookup(child, 0);
+    if(PTE2PA(*ppte) != PTE2PA(*cpte) || kpage_refcnt(pa) != 2 ||
+       (*ppte & PTE_W) || !(*cpte & PTE_COW)) {
+        printf("pages not shared copy-on-write\n");
+        return;
+    }
+
+    // 子进程写入时得到自己的副本，父进程的页不受影响
+    char *copy = (char*)uvmcow(child, 0);
+    if(copy == 0 || copy == pa || copy[0] != 'p' || kpage_refcnt(pa) != 1) {
+        printf("child write did not copy\n");
+        return;
+    }
+    copy[0] = 'c';
+    // 父进程是最后一个引用者，直接恢复写权限
+    if((char*)uvmcow(parent, 0) != pa || pa[0] != 'p' || !(*ppte & PTE_W)) {
+        printf("parent write failed\n");
+        return;
+    }
+
+    uvmfree(parent, PGSIZE);
+    uvmfree(child, PGSIZE);
+    printf("copy-on-write test passed.\n");
+}
+
+// 读缺页映射共享的零页，写入时换成私有的清零页，零页的引用随之减少
+void test_zero_page(void) {
+    printf("=== zero page test ===\n");
+    pagetable_t pt = create_pagetable();
+    if(pt == 0) {
+        printf("allocation failed\n");
+        return;
+    }
+
+    // 两个读缺页映射的是同一个零页，各持有一个引用
+    char *zp = (char*)uvm_mapzero(pt, 0, PTE_R, 1);
+    if(zp == 0) {
+        printf("uvm_mapzero failed\n");
+        return;
+    }
+    int ref = kpage_refcnt(zp);
+    if((char*)uvm_mapzero(pt, PGSIZE, PTE_R, 1) != zp || kpage_refcnt(zp) != ref + 1 ||
+       walkaddr(pt, 0) != (uint64)zp || zp[0] != 0) {
+        printf("read faults do not share the zero page\n");
+        return;
+    }
+    pte_t *pte = walk_lookup(pt, 0);
+    if((*pte & PTE_W) || !(*pte & PTE_COW)) {
+        printf("zero page mapped writable\n");
+        return;
+    }
+
+    // 写入第一页：得到自己的清零页，第二页仍然映射零页
+    char *pa = (char*)uvmcow(pt, 0);
+    if(pa == 0 || pa == zp || walkaddr(pt, 0) != (uint64)pa || !(*pte & PTE_W) ||
+       kpage_refcnt(zp) != ref || walkaddr(pt, PGSIZE) != (uint64)zp) {
+        printf("write did not break the zero page sharing\n");
+        return;
+    }
+    for(int i = 0; i < PGSIZE; i++) {
+        if(pa[i] != 0) {
+            printf("new page not zeroed\n");
+            return;
+        }
+    }
+    pa[0] = 'w';
+    if(zp[0] != 0) {
+        printf("write reached the zero page\n");
+        return;
+    }
+
+    uvmfree(pt, 2 * PGSIZE);
+    if(kpage_refcnt(zp) != ref - 1) {
+        printf("zero page reference leaked\n");
+        return;
+    }
+    printf("zero page test passed.\n");
+}
+
+// 系统调用往返开销：创建一个真正的用户进程，在用户态循环执行 getpid，
+// 每次都经过 trampoline 进出内核、切换用户页表和内核视图页表。
+// 每轮先读几页用户数据，再发起系统调用，TLB 里的用户页和内核页都会用到。
+// 对比旧的做法（每次进出内核都全局 sfence.vma）和按 ASID 区分、不刷新 TLB 的做法
+#define SYSCALL_ROUNDS 20000
+
+// 用户代码，s0 为循环次数，s2..s5 指向要读的四个数据页
+static const uint32 syscall_bench_code[] = {
+    0x00093283,     // loop: ld t0, 0(s2)
+    0x0009b283,     //       ld t0, 0(s3)
+    0x000a3283,     //       ld t0, 0(s4)
+    0x000ab283,     //       ld t0, 0(s5)
+    0x00b00893,     //       li a7, SYS_getpid
+    0x00000073,     //       ecall
+    0xfff40413,     //       addi s0, s0, -1
+    0xfe0412e3,     //       bnez s0, loop
+    0x00000513,     //       li a0, 0
+    0x00200893,     //       li a7, SYS_exit
+    0x00000073,     //       ecall
+    0x0000006f,     // spin: j spin
+};
+
+extern struct spinlock wait_lock;
+
+// 运行一次测试进程，返回从它就绪到被回收用掉的时钟数，失败返回 0
+static uint64
+syscall_bench_run(int flush)
+{
+    struct proc *p = allocproc();
+    if(p == 0)
+        return 0;
+
+    uvminit(p->pagetable, (uchar *)syscall_bench_code, sizeof(syscall_bench_code));
+    p->sz = 5 * PGSIZE;     // 代码页之后的四页在第一次读时映射零页
+    p->trapframe->epc = 0;
+    p->trapframe->s0 = SYSCALL_ROUNDS;
+    p->trapframe->s2 = 1 * PGSIZE;
+    p->trapframe->s3 = 2 * PGSIZE;
+    p->trapframe->s4 = 3 * PGSIZE;
+    p->trapframe->s5 = 4 * PGSIZE;
+    safestrcpy(p->name, "syscallbench", sizeof(p->name));
+
+    // 和 kfork 一样，不能在持有 p->lock 时取 wait_lock
+    release(&p->lock);
+    acquire(&wait_lock);
+    p->parent = myproc();
+    release(&wait_lock);
+
+    trap_trace = 0;
+    trap_flushtlb = flush;
+    uint64 start = r_time();
+    acquire(&p->lock);
+    setrunnable(p);
+    release(&p->lock);
+    int pid = kwait(0);
+    uint64 t = r_time() - start;
+    trap_flushtlb = 0;
+    trap_trace = 1;
+    return pid < 0 ? 0 : t;
+}
+
+void test_syscall_bench(void) {
+    printf("=== syscall round trip bench ===\n");
+    uint64 global = syscall_bench_run(1);
+    uint64 tagged = syscall_bench_run(0);
+    if(global == 0 || tagged == 0) {
+        printf("bench process failed\n");
+        return;
+    }
+    printf("%d syscalls: global sfence %ld ticks (%ld per call), asid %ld ticks (%ld per call)\n",
+           SYSCALL_ROUNDS, global, global / SYSCALL_ROUNDS, tagged, tagged / SYSCALL_ROUNDS);
+}
+
+// 2MB 区域填满后合并成大页，部分解除映射时拆回 4KB 页
+void test_superpage(void) {
+    printf("=== superpage test ===\n");
+    uint64 base = 2 * 1024 * 1024;
+    pagetable_t pt = create_pagetable();
+    if(pt == 0) {
+        printf("allocation failed\n");
+        return;
+    }
+    // 和缺页处理一样每填入一页调用一次，填满之前不合并
+    uint64 promoted = 0;
+    for(int i = 0; i < 512; i++) {
+        char *pa = kalloc();
+        if(pa == 0 || map_page(pt, base + i*PGSIZE, (uint64)pa, PTE_R | PTE_W | PTE_U) != 0) {
+            printf("map failed\n");
+            return;
+        }
+        pa[0] = i & 0xff;
+        if((promoted = uvm_promote(pt, base + i*PGSIZE, 2 * base)) != 0 && i != 511) {
+            printf("promoted early at page %d\n", i);
+            return;
+        }
+    }
+
+    int level;
+    if(promoted == 0 || walk_lookup_level(pt, base, &level) == 0 || level != 1) {
+        printf("region not promoted\n");
+        return;
+    }
+    char *blk = (char*)walkaddr(pt, base);
+    for(int i = 0; i < 512; i++) {
+        if((uchar)blk[i*PGSIZE] != (i & 0xff)) {
+            printf("content lost at page %d\n", i);
+            return;
+        }
+    }
+
+    // 解除中间一页，大页被原地拆开，其余页的内容和物理地址不变
+    uvmunmap(pt, base + 7*PGSIZE, 1, 1);
+    if(walk_lookup_level(pt, base, &level) == 0 || level != 0 ||
+       ismapped(pt, base + 7*PGSIZE) || walkaddr(pt, base + 8*PGSIZE) != (uint64)blk + 8*PGSIZE) {
+        printf("partial unmap did not split\n");
+        return;
+    }
+
+    uvmfree(pt, 2 * base);
+    printf("superpage test passed.\n");
+}
@@ -15,12 +15,34 @@ struct spinlock tickslock;
 
 uint ticks;
 
+// 系统调用往返测试用的开关：trap_trace 为 0 时不打印每次陷入的调试信息，
+// trap_flushtlb 为 1 时每次进出内核都全局刷新 TLB，模拟没有 ASID 时的旧做法
+int trap_trace = 1;
+int trap_flushtlb = 0;
+
 extern char trampoline[], uservec[];
 
 void kernelvec();
 
 extern int devintr();
 
+// 异常修复表，由 uaccess.S 中访问用户内存的指令登记，位置由 kernel.ld 给出
+struct exentry {
+    uint64 insn;    // 可能出错的指令地址
+    uint64 fixup;   // 出错后继续执行的地址
+};
+extern struct exentry __ex_table_start[], __ex_table_end[];
+
+// 查找出错指令 pc 的修复代码，不在表中返回 0
+static uint64
+search_fixup(uint64 pc)
+{
+    for(struct exentry *e = __ex_table_start; e < __ex_table_end; e++)
+        if(e->insn == pc)
+            return e->fixup;
+    return 0;
+}
+
 
 // 注册某IRQ的处理函数
 void register_interrupt(int irq, void (*handler)(void)) {
@@ -42,6 +64,7 @@ void handle_clockintr(void) {
         release(&tickslock);
     }
     printf("clock interrupt\n");
+    sched_balance();    // 定期从过长的就绪队列拉一个进程过来
     // 请求下一次定时器中断。这也会清除中断请求。1000000 大约是十分之一秒。
     w_stimecmp(r_time() + 1000000);
 }
@@ -54,21 +77,37 @@ void handle_illegal_instruction(void) {
 }
 
 void handle_load_page_fault(void) {
-    // struct proc *p = myproc();
-    // printf("Load page fault: pid=%d sepc=0x%lx stval=0x%lx\n", p->pid, r_sepc(), r_stval());
-    // setkilled(p);
+    struct proc *p = myproc();
+    // 第一次访问懒分配的堆页
+    uvm_lock(p);
+    uint64 pa = vmfault(p->pagetable, r_stval(), 1);
+    uvm_unlock(p);
+    if(pa != 0)
+        return;
+    printf("Load page fault: pid=%d sepc=0x%lx stval=0x%lx\n", p->pid, r_sepc(), r_stval());
+    setkilled(p);
 }
 
 void handle_store_page_fault(void) {
-    // struct proc *p = myproc();
-    // printf("Store page fault: pid=%d sepc=0x%lx stval=0x%lx\n", p->pid, r_sepc(), r_stval());
-    // setkilled(p);
+    struct proc *p = myproc();
+    // 写时复制页：复制后返回用户态重新执行这条指令，
+    // 否则是第一次写入懒分配的堆页
+    uvm_lock(p);
+    uint64 pa = uvmcow(p->pagetable, r_stval());
+    if(pa == 0)
+        pa = vmfault(p->pagetable, r_stval(), 0);
+    uvm_unlock(p);
+    if(pa != 0)
+        return;
+    printf("Store page fault: pid=%d sepc=0x%lx stval=0x%lx\n", p->pid, r_sepc(), r_stval());
+    setkilled(p);
 }
 
 void handle_syscall(void) {
     struct proc *p = myproc();
     // 处理系统调用逻辑
-    printf("Syscall: pid=%d syscallno=%ld\n", p->pid, p->trapframe->a7);
+    if(trap_trace)
+        printf("Syscall: pid=%d syscallno=%ld\n", p->pid, p->trapframe->a7);
     // ...系统调用实现...
     p->trapframe->epc += 4; // 用户进程系统调用返回后，执行下一条指令
 
@@ -93,6 +132,7 @@ trapinit(void)
     register_interrupt(5, handle_clockintr);           // 5: 时钟中断
     register_interrupt(2, handle_illegal_instruction); // 2: 非法指令
     register_interrupt(8, handle_syscall);             // 8: 系统调用
+    register_interrupt(12, handle_load_page_fault);    // 12: 取指错误（代码页可能被换出）
     register_interrupt(13, handle_load_page_fault);    // 13: 访存错误
     register_interrupt(15, handle_store_page_fault);   // 15: 访存出错
 }
@@ -106,8 +146,9 @@ trapinithart(void)
 uint64
 usertrap(void)
 {
-    printf("[Usertrap] scause=0x%lx sepc=0x%lx stval=0x%lx\n",
-        r_scause(), r_sepc(), r_stval());
+    if(trap_trace)
+        printf("[Usertrap] scause=0x%lx sepc=0x%lx stval=0x%lx\n",
+            r_scause(), r_sepc(), r_stval());
 
     int which_dev = 0;
 
@@ -116,6 +157,8 @@ usertrap(void)
         panic("usertrap: not from user mode");
 
     w_stvec((uint64)kernelvec);
+    if(trap_flushtlb)
+        sfence_vma();
 
     struct proc *p = myproc();
 
@@ -129,8 +172,8 @@ usertrap(void)
         interrupt_dispatch(8);
     } else if(which_dev == 2){ // 时钟中断
         yield();
-    } else if(exc_code == 13){ // load page fault
-        interrupt_dispatch(13);
+    } else if(exc_code == 12 || exc_code == 13){ // instruction / load page fault
+        interrupt_dispatch(exc_code);
     } else if(exc_code == 15){ // store page fault
         interrupt_dispatch(15);
     } else if(exc_code == 2){  // 非法指令
@@ -152,8 +195,12 @@ usertrap(void)
         panic("father wait return");
     }
 
-    // 设置回用户态的页表
-    uint64 satp = MAKE_SATP(p->pagetable);
+    // 旧做法在 trampoline 切回用户页表后刷新，这里提前刷新，效果相同
+    if(trap_flushtlb)
+        sfence_vma();
+
+    // 设置回用户态的页表，带上进程的 ASID
+    uint64 satp = uvm_satp(p);
     return satp;
 }
 
@@ -174,16 +221,20 @@ prepare_return(void)
     w_stvec(trampoline_uservec);
 
     // 设置 trapframe 的值，uservec 在下次进程 trap 到内核时会用到。
-    p->trapframe->kernel_satp = r_satp();         // 内核页表
-    p->trapframe->kernel_sp = p->kstack + PGSIZE; // 进程的内核栈
+    p->trapframe->kernel_satp = r_satp();         // 内核视图页表，带着进程的 ASID
+    p->trapframe->kernel_sp = p->kstack + KSTACKSIZE; // 进程的内核栈
     p->trapframe->kernel_trap = (uint64)usertrap;
     p->trapframe->kernel_hartid = r_tp();         // 用于 cpuid() 的 hartid
 
+    // trapframe 不一定在页首，uservec/userret 从 sscratch 取得它的用户虚拟地址
+    w_sscratch(TRAPFRAME_VA(p->trapframe));
+
     // 设置 trampoline.S 的 sret 指令用于返回用户态的寄存器值
 
     // 设置 S Previous Privilege mode 为 User。
     unsigned long x = r_sstatus();
     x &= ~SSTATUS_SPP; // 清除 SPP，设置为用户态
+    x &= ~SSTATUS_SUM; // 内核只在 uaccess.S 的拷贝函数中访问用户内存
     x |= SSTATUS_SPIE; // 允许用户态中断
     w_sstatus(x);
 
@@ -214,9 +265,17 @@ kerneltrap()
   // 中断期间不处理其他中断，防止内核栈的溢出
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
+  // 可能打断了正在复制用户内存的 __copy_user，处理期间（包括 yield 到别的进程）关掉 SUM，
+  // 返回前由下面的 w_sstatus(sstatus) 恢复
+  w_sstatus(sstatus & ~SSTATUS_SUM);
 
   // 0 表示未知中断源
   if((which_dev = devintr()) == 0){
+    // 直接访问用户内存时缺页或者权限不对，跳到修复代码，由拷贝函数返回后处理
+    uint64 fixup;
+    if((scause == 13 || scause == 15) && (fixup = search_fixup(sepc)) != 0) {
+      sepc = fixup;
+    }
     // interrupt or trap from an unknown source
     // printf("scause=0x%lx sepc=0x%lx stval=0x%lx\n", scause, r_sepc(), r_stval());
     // panic("kerneltrap");
@@ -245,8 +304,8 @@ devintr()
 
         if(irq == UART0_IRQ){
 
-        } else if(irq == VIRTIO0_IRQ){
-
+        } else if(irq && irq == virtio_disk_irq){
+            virtio_disk_intr();
         }
 
         if(irq)
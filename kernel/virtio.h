@@ -49,7 +49,8 @@
 #define VIRTIO_RING_F_EVENT_IDX     29	/* 支持事件索引 */
 
 // virtio 描述符数量，必须为 2 的幂
-#define NUM 8
+// 每个请求占三个，换页时会有多个整页请求同时进行
+#define NUM 32
 
 // 单个描述符结构体，参见规范
 struct virtq_desc {
@@ -14,10 +14,15 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "proc.h"
+#include "swap.h"
 #include "virtio.h"
 
 // the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+#define R(r) ((volatile uint32 *)(vbase + (r)))
+
+static uint64 vbase;    // 磁盘所在 virtio mmio 槽位的基地址
+int virtio_disk_irq;    // 磁盘的 PLIC 中断号
 
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
@@ -47,6 +52,7 @@ static struct disk {
   // indexed by first descriptor index of chain.
   struct {
     struct buf *b;
+    struct swapreq *r;  // 异步的整页请求，完成时由中断释放描述符
     char status;
   } info[NUM];
 
@@ -61,6 +67,21 @@ static struct disk {
 void
 virtio_disk_init(void)
 {
+  // 在设备树给出的槽位中找第一个块设备（device id 2）
+  for(int i = 0; i < nvirtio; i++){
+    volatile uint32 *regs = (volatile uint32 *)virtio_mmio[i].base;
+    if(regs == 0)
+      continue;
+    if(regs[VIRTIO_MMIO_MAGIC_VALUE/4] == 0x74726976 &&
+       regs[VIRTIO_MMIO_DEVICE_ID/4] == 2){
+      vbase = virtio_mmio[i].base;
+      virtio_disk_irq = virtio_mmio[i].irq;
+      break;
+    }
+  }
+  if(vbase == 0)
+    panic("could not find virtio disk");
+
   printf("virtio regs: magic=%x ver=%x did=%x vid=%x\n",
     *R(VIRTIO_MMIO_MAGIC_VALUE),
     *R(VIRTIO_MMIO_VERSION),
@@ -122,15 +143,12 @@ virtio_disk_init(void)
   if(max < NUM)
     panic("virtio disk max queue too short");
 
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
+  // allocate zeroed queue memory.
+  disk.desc = kalloc_zeroed();
+  disk.avail = kalloc_zeroed();
+  disk.used = kalloc_zeroed();
   if(!disk.desc || !disk.avail || !disk.used)
     panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
 
   // set queue size.
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
@@ -154,7 +172,7 @@ virtio_disk_init(void)
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
   *R(VIRTIO_MMIO_STATUS) = status;
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  // plic.c and trap.c arrange for interrupts from virtio_disk_irq.
 }
 
 // find a free descriptor, mark it non-free, return its index.
@@ -217,13 +235,26 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// 等待 chan 上的事件，调用者持有 vdisk_lock
+// 换页可能发生在持有其他自旋锁的时候（比如管道在锁内拷贝用户内存），
+// 这时不能睡眠，改为自己轮询完成队列
+static void
+disk_wait(void *chan)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  if(myproc() != 0 && mycpu()->noff == 1){
+    sleep(chan, &disk.vdisk_lock);
+  } else {
+    release(&disk.vdisk_lock);
+    virtio_disk_intr();
+    acquire(&disk.vdisk_lock);
+  }
+}
 
+// 组织三个描述符并通知设备，返回描述符链的头，调用者持有 vdisk_lock
+// b 和 r 只有一个非 0，记录下来供 virtio_disk_intr() 使用
+static int
+disk_submit(uint64 sector, void *data, uint len, int write, struct buf *b, struct swapreq *r)
+{
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
   // data, one for a 1-byte status result.
@@ -234,7 +265,7 @@ virtio_disk_rw(struct buf *b, int write)
     if(alloc3_desc(idx) == 0) {
       break;
     }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+    disk_wait(&disk.free[0]);
   }
 
   // format the three descriptors.
@@ -254,8 +285,8 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  disk.desc[idx[1]].addr = (uint64) data;
+  disk.desc[idx[1]].len = len;
   if(write)
     disk.desc[idx[1]].flags = 0; // device reads b->data
   else
@@ -270,8 +301,12 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[2]].next = 0;
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
+  if(b)
+    b->disk = 1;
+  else
+    r->busy = 1;
   disk.info[idx[0]].b = b;
+  disk.info[idx[0]].r = r;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -285,14 +320,44 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
+  return idx[0];
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+
+  int id = disk_submit(b->blockno * (BSIZE / 512), b->data, BSIZE, write, b, 0);
+
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
+    disk_wait(b);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  disk.info[id].b = 0;
+  free_chain(id);
+
+  release(&disk.vdisk_lock);
+}
+
+// 发起一次整页的读写后立即返回，不等待完成
+// 完成时 virtio_disk_intr() 清除 r->busy 并唤醒 r
+void
+virtio_disk_page(struct swapreq *r)
+{
+  acquire(&disk.vdisk_lock);
+  disk_submit((uint64)r->blockno * (BSIZE / 512), r->pa, PGSIZE, r->write, 0, r);
+  release(&disk.vdisk_lock);
+}
 
+// 等待 virtio_disk_page() 发起的请求完成
+void
+virtio_disk_wait(struct swapreq *r)
+{
+  acquire(&disk.vdisk_lock);
+  while(r->busy)
+    disk_wait(r);
   release(&disk.vdisk_lock);
 }
 
@@ -322,8 +387,17 @@ virtio_disk_intr()
       panic("virtio_disk_intr status");
 
     struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct swapreq *r = disk.info[id].r;
+    if(b){
+      b->disk = 0;   // disk is done with buf
+      wakeup(b);
+    } else if(r){
+      // 发起者不在这里等待，由中断释放描述符
+      disk.info[id].r = 0;
+      free_chain(id);
+      r->busy = 0;
+      wakeup(r);
+    }
 
     disk.used_idx += 1;
   }
@@ -4,10 +4,18 @@
 #include "printf.h"
 #include "memlayout.h"
 #include "proc.h"
+#include "page.h"
 #include <stdint.h>
 
 pagetable_t kernel_pagetable;
 
+// 全局只读的零页：读缺页时映射它，第一次写入时由 uvmcow() 换成私有页
+// 这里持有一个引用，所以计数不会降到 1，也就不会被当作私有页直接改成可写
+static char *zero_page;
+
+// 用户 2MB 大页对应的伙伴系统阶
+#define MEGA_ORDER 9
+
 extern char _etext[];
 extern char trampoline[]; // trampoline.S
 
@@ -19,17 +27,16 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
     if(sz >= PGSIZE)
       panic("uvminit: more than a page");
     
-    // 分配一页物理内存
-    mem = kalloc();
+    // 分配一页清零的物理内存
+    mem = kalloc_zeroed();
     if(mem == 0)
       panic("uvminit: kalloc");
-    
-    // 清零内存页
-    memset(mem, 0, PGSIZE);
+    kpage_settype(mem, PG_USER);
     
     // 将物理页映射到用户虚拟地址空间的0处
     // 设置用户权限：可读、可写、可执行
-    if(map_page(pagetable, 0, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U) != 0)
+    // 内容不是全 0，置上 D 位，换出时要写盘
+    if(map_page(pagetable, 0, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U|PTE_A|PTE_D) != 0)
       panic("uvminit: mappages");
     
     // 将初始代码复制到分配的内存中
@@ -39,19 +46,15 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 pagetable_t
 kvmmake(void)
 {
-  pagetable_t kpgtbl = (pagetable_t)kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  pagetable_t kpgtbl = (pagetable_t)kalloc_zeroed();
+  kpage_settype(kpgtbl, PG_PAGETABLE);
 
-  // 1. 设备区 UART
-  map_region(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
-
-  // virtio mmio disk interface
-  map_region(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  // 1. 设备区 UART、virtio、PLIC
+  if(kvm_mapdevs(kpgtbl) != 0)
+    panic("kvmmake: devices");
 
   // 映射 CLINT 区域（定时器、软件中断）
 //   map_region(kpgtbl, 0x02000000, 0x02000000, 0x10000, PTE_R | PTE_W);
-   // PLIC
-  map_region(kpgtbl, PLIC, PLIC, 0x4000000, PTE_R | PTE_W);
 
   // 假设 KERNBASE、PHYSTOP 已定义为物理内存区的开始和结束
   map_region(kpgtbl, KERNBASE, KERNBASE, (uint64)_etext - KERNBASE, PTE_R | PTE_X);
@@ -61,14 +64,76 @@ kvmmake(void)
   // 7. 把trampoline和进程的这段物理地址都映射到TRAMPOLINE
   map_region(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  proc_mapstacks(kpgtbl);
+  // 进程的内核栈在 allocproc() 中按需映射，
+  // 这里先建好它们的中间页表，之后复制出去的内核视图页表都能看到
+  for(uint64 va = KSTACK(NPROC - 1); va < KSTACKTOP; va += PGSIZE)
+    if(walk_create(kpgtbl, va) == 0)
+      panic("kvmmake: kstack");
 
   return kpgtbl;
 }
 
+// 映射设备寄存器，内核页表和每个用户页表都要映射（后者没有 PTE_U，用户态不可访问）
+// UART 和默认的 virtio 槽位位于同一个 2MB 里，和 PLIC 一样用大页
+int
+kvm_mapdevs(pagetable_t pt)
+{
+  if(map_region(pt, PLIC, PLIC, 0x4000000, PTE_R | PTE_W) != 0)
+    return -1;
+  if(map_region(pt, UART0, UART0, LEVELSIZE(1), PTE_R | PTE_W) != 0)
+    return -1;
+
+  // 设备树里不在这 2MB 之内的 virtio mmio 槽位
+  for(int i = 0; i < nvirtio; i++) {
+    uint64 base = virtio_mmio[i].base;
+    if(base && (base < UART0 || base >= UART0 + LEVELSIZE(1)))
+      if(map_region(pt, base, base, PGSIZE, PTE_R | PTE_W) != 0)
+        return -1;
+  }
+  return 0;
+}
+
+// 为用户页表 upt 创建内核视图页表：根页表复制自内核页表，
+// 用户空间所在的第 0 项和最后一项换成 upt 的子树，之后 upt 的修改自动可见。
+// 只有根页表这一页属于它，用 kfree() 释放。
+pagetable_t
+uvm_kview(pagetable_t upt)
+{
+  pagetable_t kpt = create_pagetable();
+
+  if(kpt == 0)
+    return 0;
+  memmove(kpt, kernel_pagetable, PGSIZE);
+  kpt[PX(2, 0)] = upt[PX(2, 0)];
+  kpt[PX(2, TRAMPOLINE)] = upt[PX(2, TRAMPOLINE)];
+  return kpt;
+}
+
+// 回到内核页表，进程让出 CPU 之后由 scheduler() 调用
+void
+kvm_switch(void)
+{
+  w_satp(MAKE_SATP(kernel_pagetable));
+}
+
 // 创建内核页表
 void kvminit(void) {
     kernel_pagetable = kvmmake();
+    if((zero_page = kalloc_zeroed()) == 0)
+        panic("kvminit: zero page");
+    kpage_settype(zero_page, PG_USER);
+}
+
+// 把零页只读映射到 va，cow 非 0 时写入会复制出私有页，否则写入是权限错误
+// 返回零页的物理地址，失败返回 0
+uint64
+uvm_mapzero(pagetable_t pagetable, uint64 va, int perm, int cow)
+{
+    perm = (perm & ~(PTE_W | PTE_D)) | PTE_U | PTE_A | (cow ? PTE_COW : 0);
+    if(map_page(pagetable, va, (uint64)zero_page, perm) != 0)
+        return 0;
+    kpage_ref(zero_page);
+    return (uint64)zero_page;
 }
 
 // 激活内核页表
@@ -79,57 +144,180 @@ void kvminithart(void) {
     uint64_t satp = SATP_SV39 | (pa >> 12);
     // 内联汇编，意思是“把satp的值写入SATP寄存器”
     asm volatile("csrw satp, %0" : : "r"(satp));
-    asm volatile("sfence.vma zero, zero");
+    sfence_vma();
+}
+
+// ASID 分配
+// 每个进程在被调度时持有一个当前代的 ASID，高位记录分配时的代数。
+// 进程的内核视图页表和用户页表共用这个 ASID，
+// 一代之内 ASID 只递增不回收，用完之后代数加一，
+// 各 hart 发现自己的 TLB 属于旧的一代时刷新整个 TLB，进程也随之重新分配。
+// 这样进出内核和进程切换都不需要刷新 TLB。
+#define ASID_GEN  (1UL << 16)
+#define ASID_MASK (ASID_GEN - 1)
+
+static struct {
+    struct spinlock lock;
+    uint64 gen;         // 当前代数，以 ASID_GEN 为单位
+    uint64 next;        // 本代下一个可用的 ASID
+    uint64 max;         // 硬件支持的最大 ASID，0 表示不支持
+} asids;
+
+// 探测硬件实现的 ASID 位数：往 ASID 字段写全 1，读回来的就是最大值
+void
+asidinit(void)
+{
+    uint64 satp = r_satp();
+
+    initlock(&asids.lock, "asid");
+    w_satp(satp | SATP_ASID_MASK);
+    asids.max = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+    w_satp(satp);
+    sfence_vma();
+    asids.gen = ASID_GEN;
+    asids.next = 1;     // ASID 0 留给内核
+    printf("asid: %ld available\n", asids.max);
+}
+
+// 切换到进程 p 的内核视图页表，必要时分配新的 ASID 并刷新 TLB
+// 由 scheduler() 在切换到 p 之前调用，调用者已关闭中断
+void
+uvm_switch(struct proc *p)
+{
+    struct cpu *c = mycpu();
+    int cpu = cpuid();
+    uint64 gen;
+
+    if(asids.max == 0) {
+        // 不支持 ASID，所有页表都是 0 号，换进程时刷新整个 TLB
+        w_satp(MAKE_SATP(p->kpagetable));
+        sfence_vma();
+        p->lastcpu = cpu;
+        p->tlbflush = 0;
+        return;
+    }
+
+    acquire(&asids.lock);
+    if((p->asid & ~ASID_MASK) != asids.gen) {
+        if(asids.next > asids.max) {
+            asids.gen += ASID_GEN;
+            asids.next = 1;
+        }
+        p->asid = asids.gen | asids.next++;
+        p->lastcpu = cpu;   // 新的 ASID 在本代中没有用过，TLB 里不会有它的表项
+    }
+    gen = asids.gen;
+    release(&asids.lock);
+
+    w_satp(MAKE_SATP(p->kpagetable) | ((p->asid & ASID_MASK) << SATP_ASID_SHIFT));
+    if(c->asid_gen != gen) {
+        // 本 hart 的 TLB 中可能有上一代同号 ASID 的表项
+        c->asid_gen = gen;
+        sfence_vma();
+    } else if(p->lastcpu != cpu || p->tlbflush) {
+        // 本 hart 上可能留有该进程以前的旧表项，或者页表被换出修改过
+        sfence_vma_asid(p->asid & ASID_MASK);
+    }
+    p->lastcpu = cpu;
+    p->tlbflush = 0;
+}
+
+// 返回进程 p 返回用户态时使用的 satp，ASID 和当前的内核视图页表相同
+uint64
+uvm_satp(struct proc *p)
+{
+    return MAKE_SATP(p->pagetable) | ((p->asid & ASID_MASK) << SATP_ASID_SHIFT);
+}
+
+// 修改了页表 pt 中 va 所在页的映射后调用，va 不小于 MAXVA 时表示整个用户空间
+// 当前进程的用户页表也挂在正在使用的内核视图页表上，内核随后可能直接访问这些地址，
+// 所以立即刷新本 hart 上该 ASID 的表项（不支持 ASID 时是 0 号，同样有效）
+void
+uvm_changed(pagetable_t pt, uint64 va)
+{
+    struct proc *p = myproc();
+
+    if(p == 0 || p->pagetable != pt)
+        return;
+    if(va >= MAXVA)
+        sfence_vma_asid(p->asid & ASID_MASK);
+    else
+        sfence_vma_page(PGROUNDDOWN(va), p->asid & ASID_MASK);
 }
 
 pagetable_t
 create_pagetable(void)
 {
     pagetable_t pagetable;
-    pagetable = (pagetable_t) kalloc(); // 分配一页内存给页表
+    pagetable = (pagetable_t) kalloc_zeroed(); // 分配一页清零的内存给页表
     if(pagetable == 0) {
         printf("create_pagetable: kalloc failed\n");
         return 0;
     }
-    memset(pagetable, 0, PGSIZE); // 初始化页表内容为0
+    kpage_settype(pagetable, PG_PAGETABLE);
+    pa2page(pagetable)->nfill = 0;
     return pagetable;
 }
 
-// walk_create: 返回va的叶子PTE指针，必要时自动创建中间页表
-// 类似xv6的walk
+// walk_create_level: 返回va在第level级页表中的PTE指针，必要时自动创建中间页表
+// level为0时得到普通4KB页的PTE，为1/2时用于放置2MB/1GB的大页叶子
+// 途中遇到已有的大页叶子时返回0
 pte_t*
-walk_create(pagetable_t pt, uint64 va)
+walk_create_level(pagetable_t pt, uint64 va, int level)
 {
-    for(int level = 2; level > 0; level--) {
-        pte_t *pte = &pt[PX(level, va)];
+    for(int l = 2; l > level; l--) {
+        pte_t *pte = &pt[PX(l, va)];
         if(*pte & PTE_V) {
+            if(PTE_LEAF(*pte))
+                return 0;                       // 已被大页映射覆盖
             pt = (pagetable_t) PTE2PA(*pte);    // 下一级页表
         } else {
-            pt = (pagetable_t) kalloc();
+            pt = (pagetable_t) kalloc_zeroed();
             if(pt == 0) {
                 return 0;
             }
-            memset(pt, 0, PGSIZE);
+            kpage_settype(pt, PG_PAGETABLE);
+            pa2page(pt)->nfill = 0;
             *pte = PA2PTE(pt) | PTE_V;
         }
     }
-    return &pt[PX(0, va)];
+    return &pt[PX(level, va)];
 }
 
-// walk_lookup: 返回va的叶子PTE指针，找不到返回0
+// walk_create: 返回va的叶子PTE指针，必要时自动创建中间页表
+// 类似xv6的walk
 pte_t*
-walk_lookup(pagetable_t pt, uint64 va)
+walk_create(pagetable_t pt, uint64 va)
 {
-    for(int level = 2; level > 0; level--) {
-        pte_t *pte = &pt[PX(level, va)];
-        if(*pte & PTE_V) {
-            pt = (pagetable_t) PTE2PA(*pte);    // 下一级页表
-        } else {
+    return walk_create_level(pt, va, 0);
+}
+
+// walk_lookup_level: 返回映射va的叶子PTE指针，找不到返回0
+// 叶子可能位于第1/2级（大页），其级别通过*plevel返回（plevel可以为0）
+pte_t*
+walk_lookup_level(pagetable_t pt, uint64 va, int *plevel)
+{
+    int level;
+    pte_t *pte;
+
+    for(level = 2; level > 0; level--) {
+        pte = &pt[PX(level, va)];
+        if((*pte & PTE_V) == 0)
             return 0;
-        }
+        if(PTE_LEAF(*pte))
+            break;                              // 大页叶子
+        pt = (pagetable_t) PTE2PA(*pte);        // 下一级页表
     }
-    
-    return &pt[PX(0, va)];
+    if(plevel)
+        *plevel = level;
+    return &pt[PX(level, va)];
+}
+
+// walk_lookup: 返回va的叶子PTE指针，找不到返回0
+pte_t*
+walk_lookup(pagetable_t pt, uint64 va)
+{
+    return walk_lookup_level(pt, va, 0);
 }
 
 // map_page: 建立va->pa的单页映射
@@ -145,20 +333,54 @@ int map_page(pagetable_t pt, uint64 va, uint64 pa, int perm) {
     if(*pte & PTE_V)
         return -2; // 已映射
     *pte = PA2PTE(pa) | perm | PTE_V;
+    uvm_changed(pt, va);
     return 0;
 }
 
+// 拆除地址空间时成批释放物理页，减少分配器的加锁和开关中断
+#define FREE_BATCH 32
+
+struct freebatch {
+    int n;
+    void *pa[FREE_BATCH];
+};
+
+static void
+fb_add(struct freebatch *fb, void *pa)
+{
+    fb->pa[fb->n++] = pa;
+    if(fb->n == FREE_BATCH) {
+        kfree_batch(fb->pa, fb->n);
+        fb->n = 0;
+    }
+}
+
+static void
+fb_flush(struct freebatch *fb)
+{
+    if(fb->n > 0)
+        kfree_batch(fb->pa, fb->n);
+    fb->n = 0;
+}
+
+static int unmap_level(pagetable_t, pagetable_t, int, uint64, uint64, int, int, struct freebatch *);
+
 // 释放整个页表
 // (包括中间页表的页表项和叶子节点的实际物理页)
 void uvmfree(pagetable_t pagetable, uint64 sz)
 {
-    if(sz > 0)
-        uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+    struct freebatch fb = { 0 };
+
+    // 完全落在 [0, sz) 内的下级页表在同一次遍历中释放，剩下的交给 destroy_pagetable
+    // 整个地址空间都在范围内，大页都是整块释放，不会拆分
+    if(sz > 0 && unmap_level(pagetable, pagetable, 2, 0, PGROUNDUP(sz), 1, 1, &fb) < 0)
+        panic("uvmfree: split");
+    fb_flush(&fb);
     destroy_pagetable(pagetable);
 }
 
 // 销毁整个页表递归释放所有页表页
-// （不释放映射的叶子节点中物理页）
+// （不释放映射的叶子节点中物理页，大页叶子同样跳过）
 void destroy_pagetable(pagetable_t pt) {
     // 遍历页表的512个条目（每个页表有512项）
     for(int i=0; i<512; ++i) {
@@ -177,60 +399,342 @@ void destroy_pagetable(pagetable_t pt) {
     kfree(pt);
 }
 
+// uvmunmap 的递归部分：清除第 level 级页表 pt 中覆盖 [va, end) 的项
+// 只进入存在的下级页表，没有映射的区域整块跳过。
+// do_free 时释放物理页和交换槽，free_tables 时释放完全位于范围内的下级页表
+// 部分落在范围内的大页要拆开，内存不足拆不开时返回 -1，已经解除的映射不恢复
+static int
+unmap_level(pagetable_t pagetable, pagetable_t pt, int level, uint64 va, uint64 end,
+            int do_free, int free_tables, struct freebatch *fb)
+{
+    uint64 a, next, e;
+
+    for(a = va; a < end; a = next) {
+        next = (a & ~(LEVELSIZE(level) - 1)) + LEVELSIZE(level);
+        e = next < end ? next : end;
+        pte_t *pte = &pt[PX(level, a)];
+        int whole = (a % LEVELSIZE(level)) == 0 && e == next;
+
+        if((*pte & PTE_V) == 0) {
+            // 没有分配物理页，跳过；换出的页释放交换槽
+            if(*pte & PTE_SWAP) {
+                if(do_free)
+                    swap_free(PTE2SLOT(*pte));
+                *pte = 0;
+            }
+            continue;
+        }
+        if(level > 0 && PTE_LEAF(*pte)) {
+            // 2MB 大页：整个在范围内时一起释放，否则先拆成 4KB 页
+            if(whole) {
+                if(do_free)
+                    kfree_pages((void*)PTE2PA(*pte), MEGA_ORDER);
+                *pte = 0;
+                continue;
+            }
+            if(uvm_split(pagetable, a) != 0)
+                return -1;
+        }
+        if(level > 0) {
+            pagetable_t child = (pagetable_t)PTE2PA(*pte);
+            if(unmap_level(pagetable, child, level - 1, a, e, do_free, free_tables, fb) < 0)
+                return -1;
+            if(whole && free_tables) {
+                *pte = 0;
+                fb_add(fb, child);
+            }
+            continue;
+        }
+        if(do_free)
+            fb_add(fb, (void*)PTE2PA(*pte));    // 释放物理页
+        *pte = 0;   // 清空页表项
+    }
+    return 0;
+}
+
 // 提供一个把进程中的所有物理页释放掉的接口
 // (也就是释放页表中的叶子节点的页表项)
-void
+// 范围的两端落在大页中间时先拆开大页，内存不足时返回 -1，这时映射没有任何改变
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
-  pte_t *pte;
+  struct freebatch fb = { 0 };
+  uint64 end = va + npages*PGSIZE;
+  int r;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    // 查找叶子页表项（即实际映射的物理页）
-    if((pte = walk_lookup(pagetable, a)) == 0)
-      continue;   // 没有分配页表项，跳过
-    if((*pte & PTE_V) == 0)
-      continue;   // 没有分配物理页，跳过
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa); // 释放物理页
+  // 中间的大页都是整块解除，只有两端需要拆分；拆开的大页内容和权限不变
+  if((va % LEVELSIZE(1)) != 0 && uvm_split(pagetable, va) != 0)
+    return -1;
+  if((end % LEVELSIZE(1)) != 0 && end < MAXVA && uvm_split(pagetable, end) != 0)
+    return -1;
+  r = unmap_level(pagetable, pagetable, 2, va, end, do_free, 0, &fb);
+  uvm_changed(pagetable, MAXVA);
+  fb_flush(&fb);
+  return r;
+}
+
+// 把进程内存从 oldsz 缩小到 newsz，释放多出来的页，返回新的大小
+// 懒分配的页可能从未映射过，uvmunmap 会跳过它们
+// 需要拆分大页而内存不足时什么都不释放，返回 oldsz
+uint64
+uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
+{
+    if(newsz >= oldsz)
+        return oldsz;
+    if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)) {
+        uint64 npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
+        if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) < 0)
+            return oldsz;
     }
-    *pte = 0; // 清空页表项
-  }
+    return newsz;
 }
 
-// 考虑改为COW
+// 写时复制：子进程和父进程共享物理页，不复制内容
+// 可写页在两边都改成只读并打上 PTE_COW，第一次写入时再由 uvmcow() 复制
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-    pte_t *pte;
-    uint64 pa, i;
+    return uvmshare(old, new, 0, sz, 1);
+}
+
+// uvmshare 的递归部分：把 old 中第 level 级页表 opt 覆盖 [va, end) 的项
+// 共享到 new 中对应的页表 npt，只进入 old 中存在的下级页表
+// 修改了 old 中的权限时置 *flipped，内存不足或者 new 中已有映射时返回 -1
+static int
+share_level(pagetable_t old, pagetable_t opt, pagetable_t npt, int level,
+            uint64 va, uint64 end, int cow, int *flipped)
+{
+    uint64 a, next, e, pa;
     uint flags;
-    char *mem;
-    
-    for(i = 0; i < sz; i += PGSIZE){
-        if((pte = walk_lookup(old, i)) == 0)
-            continue;   // old中没有映射，跳过 
-        if((*pte & PTE_V) == 0)
-            continue;   // old中没有映射，跳过
+
+    for(a = va; a < end; a = next) {
+        next = (a & ~(LEVELSIZE(level) - 1)) + LEVELSIZE(level);
+        e = next < end ? next : end;
+        pte_t *pte = &opt[PX(level, a)];
+        pte_t *npte = &npt[PX(level, a)];
+
+        if((*pte & PTE_V) == 0) {
+            if((*pte & PTE_SWAP) == 0)
+                continue;   // old中没有映射，跳过
+            // 换出的页：复制换出项，两边共用交换槽，各自换入时再分开
+            if(*npte != 0)
+                return -1;
+            *npte = *pte;
+            swap_dup(PTE2SLOT(*pte));
+            continue;
+        }
+        if(level > 0 && PTE_LEAF(*pte) && ((a % LEVELSIZE(level)) != 0 || e != next)) {
+            // 大页只有一部分在范围内，先拆开
+            if(uvm_split(old, a) != 0)
+                return -1;
+        }
+        if(level > 0 && !PTE_LEAF(*pte)) {
+            // 下一级页表，new 中没有时新建
+            if((*npte & PTE_V) == 0) {
+                pagetable_t t = create_pagetable();
+                if(t == 0)
+                    return -1;
+                *npte = PA2PTE(t) | PTE_V;
+            } else if(PTE_LEAF(*npte)) {
+                return -1;
+            }
+            if(share_level(old, (pagetable_t)PTE2PA(*pte), (pagetable_t)PTE2PA(*npte),
+                           level - 1, a, e, cow, flipped) != 0)
+                return -1;
+            continue;
+        }
+
+        // 叶子：4KB 页或者整个在范围内的大页，块的引用计数在首页上
+        if(*npte & PTE_V)
+            return -1;
         pa = PTE2PA(*pte);
         flags = PTE_FLAGS(*pte);
-        if((mem = kalloc()) == 0)
-            goto err;
-        memmove(mem, (char*)pa, PGSIZE);
-        if(map_page(new, i, pa, flags) != 0){
-            kfree(mem);
-            goto err;
+        if(cow && (flags & PTE_W)) {
+            flags = (flags & ~PTE_W) | PTE_COW;
+            *pte = PA2PTE(pa) | flags;
+            *flipped = 1;
         }
+        *npte = PA2PTE(pa) | flags;
+        kpage_ref((void*)pa);
     }
     return 0;
-    
-     err:
-    uvmunmap(new, 0, i / PGSIZE, 1);
-    return -1;
+}
+
+// 把 old 中 [start, end) 已经映射的页共享给 new
+// cow 非 0 时按写时复制共享，否则两边以相同的权限共享同一个物理页
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
+{
+    int flipped = 0;
+    int r = share_level(old, old, new, 2, start, end, cow, &flipped);
+
+    if(flipped)
+        uvm_changed(old, MAXVA);        // 父进程的可写页变成了只读，整体刷新一次
+    if(r != 0) {
+        uvmunmap(new, start, (PGROUNDUP(end) - start) / PGSIZE, 1);   // 只减少共享页的引用计数
+        return -1;
+    }
+    uvm_changed(new, MAXVA);
+    return 0;
+}
+
+// 处理对写时复制页的写入
+// 页只剩自己引用时直接恢复写权限，否则复制一份再映射
+// 返回可写的物理页地址，va 不是写时复制页或内存不足时返回 0
+uint64
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    uint64 pa;
+    uint flags;
+    char *mem;
+    int level;
+
+    if(va >= MAXVA)
+        return 0;
+    va = PGROUNDDOWN(va);
+    pte = walk_lookup_level(pagetable, va, &level);
+    if(pte == 0 || (*pte & (PTE_V | PTE_U | PTE_COW)) != (PTE_V | PTE_U | PTE_COW))
+        return 0;
+    pa = PTE2PA(*pte);
+    flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+    if(level > 0) {
+        // 2MB 大页：整块复制，没有连续的 2MB 时拆成私有的 4KB 页
+        if(kpage_refcnt((void*)pa) > 1) {
+            if((mem = kalloc_pages(MEGA_ORDER)) == 0) {
+                if(uvm_split(pagetable, va) != 0)
+                    return 0;
+                return walkaddr(pagetable, va);
+            }
+            memmove(mem, (char*)pa, LEVELSIZE(1));
+            for(int i = 0; i < (1 << MEGA_ORDER); i++)
+                kpage_settype(mem + i*PGSIZE, PG_USER);
+            kfree_pages((void*)pa, MEGA_ORDER);
+            pa = (uint64)mem;
+        }
+        *pte = PA2PTE(pa) | flags;
+        uvm_changed(pagetable, va);
+        return pa + (va & (LEVELSIZE(1) - 1));
+    }
+
+    if(kpage_refcnt((void*)pa) > 1) {
+        // 零页不用复制，直接取一页清零的内存；内存不足时先换出别的页
+        if((mem = swap_kalloc(pa == (uint64)zero_page)) == 0)
+            return 0;
+        kpage_settype(mem, PG_USER);
+        if(pa != (uint64)zero_page)
+            memmove(mem, (char*)pa, PGSIZE);
+        kfree((void*)pa);               // 减少原来共享页的引用
+        pa = (uint64)mem;
+    }
+    *pte = PA2PTE(pa) | flags;
+    uvm_changed(pagetable, va);
+
+    // 先读后写的堆页经过零页来到这里，同样算作填入一页
+    struct proc *p = myproc();
+    if(p && p->pagetable == pagetable) {
+        uint64 blk = uvm_promote(pagetable, va, p->sz);
+        if(blk)
+            return blk + (va & (LEVELSIZE(1) - 1));
+    }
+    return pa;
+}
+
+// 把覆盖 va 的 2MB 用户大页拆成 512 个 4KB 页，权限不变
+// 块只被自己引用时原地拆开，否则（fork 之后仍在共享）复制出私有的页
+// va 不在大页中或者拆分成功返回 0，内存不足返回 -1
+int
+uvm_split(pagetable_t pagetable, uint64 va)
+{
+    pte_t *pte;
+    pagetable_t l0;
+    uint64 pa;
+    uint flags;
+    char *mem;
+    int level;
+
+    pte = walk_lookup_level(pagetable, va, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0 || level != 1)
+        return 0;
+    pa = PTE2PA(*pte);
+    flags = PTE_FLAGS(*pte);
+    if((l0 = create_pagetable()) == 0)
+        return -1;
+
+    if(kpage_refcnt((void*)pa) == 1) {
+        kpage_split((void*)pa, MEGA_ORDER);
+        for(int i = 0; i < 512; i++)
+            l0[i] = PA2PTE(pa + i*PGSIZE) | flags;
+    } else {
+        // 复制出来的页是私有的，不再需要写时复制
+        if(flags & PTE_COW)
+            flags = (flags & ~PTE_COW) | PTE_W;
+        for(int i = 0; i < 512; i++) {
+            if((mem = swap_kalloc(0)) == 0) {
+                for(int j = 0; j < i; j++)
+                    kfree((void*)PTE2PA(l0[j]));
+                kfree(l0);
+                return -1;
+            }
+            kpage_settype(mem, PG_USER);
+            memmove(mem, (char*)(pa + i*PGSIZE), PGSIZE);
+            l0[i] = PA2PTE(mem) | flags;
+        }
+        kfree_pages((void*)pa, MEGA_ORDER);
+    }
+    *pte = PA2PTE(l0) | PTE_V;
+    uvm_changed(pagetable, va);
+    return 0;
+}
+
+// va 所在的 2MB 区域在 [0, sz) 内、512 个 4KB 页都已映射、
+// 都只被自己引用并且权限相同时，复制到一个连续的 2MB 块中，合并成一个大页。
+// 由缺页处理在每次填入新的私有页之后调用，返回大页的物理地址，没有合并时返回 0
+// 检查要扫描 512 项，所以只在这个区域每填入 512 页时做一次，平摊到每次缺页是常数。
+// 计数在页被换出或解除映射时不减，只决定检查的时机，不影响正确性
+uint64
+uvm_promote(pagetable_t pagetable, uint64 va, uint64 sz)
+{
+    uint64 base = va & ~(LEVELSIZE(1) - 1);
+    pte_t *pte;
+    pagetable_t l0;
+    uint flags;
+    char *blk;
+
+    if(base + LEVELSIZE(1) > sz)
+        return 0;
+    pte = walk_create_level(pagetable, base, 1);
+    if(pte == 0 || (*pte & PTE_V) == 0 || PTE_LEAF(*pte))
+        return 0;
+    l0 = (pagetable_t)PTE2PA(*pte);
+    if(++pa2page(l0)->nfill % 512 != 0)
+        return 0;
+
+    // A/D 位不影响合并，合并后的大页两者都置上
+    flags = PTE_FLAGS(l0[0]) & ~(PTE_A | PTE_D);
+    for(int i = 0; i < 512; i++) {
+        if((l0[i] & PTE_V) == 0 || (PTE_FLAGS(l0[i]) & ~(PTE_A | PTE_D)) != flags)
+            return 0;
+        if(kpage_refcnt((void*)PTE2PA(l0[i])) != 1)
+            return 0;
+    }
+    if((flags & PTE_U) == 0 || (blk = kalloc_pages(MEGA_ORDER)) == 0)
+        return 0;
+
+    for(int i = 0; i < 512; i++) {
+        memmove(blk + i*PGSIZE, (char*)PTE2PA(l0[i]), PGSIZE);
+        kpage_settype(blk + i*PGSIZE, PG_USER);
+    }
+    *pte = PA2PTE(blk) | flags | PTE_A | PTE_D;
+    uvm_changed(pagetable, MAXVA);
+    for(int i = 0; i < 512; i++)
+        kfree((void*)PTE2PA(l0[i]));
+    kfree(l0);
+    return (uint64)blk;
 }
 
 // 调试用：递归打印页表内容
@@ -268,13 +772,25 @@ void dump_pagetable(pagetable_t pt, int level) {
     }
 }
 // 连续映射一段区间
+// 只要va、pa按1GB/2MB对齐且剩余长度足够，就直接用大页叶子映射，
+// 减少页表页的数量和TLB的压力
 int map_region(pagetable_t pt, uint64 va, uint64 pa, uint64 sz, int perm) {
     if((va % PGSIZE) || (pa % PGSIZE) || (sz % PGSIZE)) // 必须页对齐
         return -1;
     uint64 end = va + sz;
-    for(; va < end; va += PGSIZE, pa += PGSIZE) {
-        if(map_page(pt, va, pa, perm) != 0)
-            return -1; // 遇到错误提前返回
+    while(va < end) {
+        int level;
+        for(level = 2; level > 0; level--) {
+            uint64 size = LEVELSIZE(level);
+            if((va % size) == 0 && (pa % size) == 0 && end - va >= size)
+                break;
+        }
+        pte_t *pte = walk_create_level(pt, va, level);
+        if(pte == 0 || (*pte & PTE_V))
+            return -1; // 内存不足或已映射，提前返回
+        *pte = PA2PTE(pa) | perm | PTE_V;
+        va += LEVELSIZE(level);
+        pa += LEVELSIZE(level);
     }
     return 0;
 }
@@ -285,179 +801,336 @@ int unmap_page(pagetable_t pt, uint64 va) {
     pte_t* pte = walk_lookup(pt, va);
     if(!pte || !(*pte & PTE_V)) return -1;
     *pte = 0;
+    uvm_changed(pt, va);
     return 0;
 }
 
 // 虚拟地址查物理地址
 uint64 walkaddr(pagetable_t pt, uint64 va) {
-    pte_t* pte = walk_lookup(pt, va);
+    int level;
+    pte_t* pte = walk_lookup_level(pt, va, &level);
     if(!pte || !(*pte & PTE_V)) return 0;
-    return PTE2PA(*pte) | (va & 0xFFF);
+    return PTE2PA(*pte) + (va & (LEVELSIZE(level) - 1));
 }
 
 /*
- * 从内核空间拷贝数据到用户空间。
- *
- * 功能：
- *   将 src 指向的内核缓冲区中的 len 字节数据，拷贝到用户页表 pagetable 所映射的虚拟地址 dstva 处。
- *   支持跨页拷贝，自动处理缺页（如页未映射时尝试 vmfault 处理）。
- *
- * 参数：
- *   pagetable - 用户进程的页表指针。
- *   dstva     - 用户空间的目标虚拟地址。
- *   src       - 源内核缓冲区指针。
- *   len       - 需要拷贝的字节数。
+ * 用户空间拷贝
  *
- * 返回值：
- *   成功返回 0，失败（如地址无效或缺页处理失败、目标页不可写）返回 -1。
- *
- * 实现细节：
- *   1. 循环处理每一页，直到所有数据拷贝完成。
- *   2. 通过 walkaddr 获取虚拟地址对应的物理地址，若未映射则调用 vmfault 处理缺页。
- *   3. 检查目标页表项是否可写（PTE_W），只允许写入可写页。
- *   4. 计算本页可拷贝的字节数 n，避免跨页越界。
- *   5. 使用 memmove 进行实际数据拷贝。
- *   6. 更新剩余字节数、源地址和目标虚拟地址，进入下一页处理。
+ * 访问当前进程的用户内存时，内核正运行在它的内核视图页表上，
+ * 直接由 uaccess.S 打开 SUM 用普通的 load/store 复制，不查页表。
+ * 缺页（懒分配、写时复制、还没调入的 mmap 页）或者地址非法时，
+ * 异常修复表让复制提前返回，再由 uvm_resolve() 处理那一页：
+ * 未映射的页交给 vmfault() 分配，写访问顺带处理写时复制，成功后接着复制。
+ * 访问别的页表时（比如测试代码）仍然逐页遍历页表，通过物理地址复制。
+ * copyoutv/copyinv 一次处理多段内核缓冲区（分散/聚集），
+ * 供 readi/writei 和管道在环形缓冲区回绕时使用。
  */
-int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+
+// 把用户地址 va 所在的页解析为该 4KB 页的物理地址
+// 写访问时处理写时复制并置 D 位（内核代替用户写入，硬件不会置位）
+// 地址非法、不是用户页或者没有写权限时返回 0
+static uint64
+uvm_resolve_page(pagetable_t pagetable, uint64 va, int write)
 {
-    uint64 n, va0, pa0;
     pte_t *pte;
+    int level;
+
+    if(va >= MAXVA)
+        return 0;
+    pte = walk_lookup_level(pagetable, va, &level);
+    if(pte == 0 || (*pte & PTE_V) == 0) {
+        // 懒分配的堆页或者 mmap 区域的页还没有调入
+        // 调用者可能持有锁，只有中断开着（没有持有自旋锁）时才允许读入文件页
+        struct proc *p = myproc();
+        if(p && va >= p->sz) {
+            if(mmap_fault(p, va, !write, intr_get()) == 0)
+                return 0;
+        } else if(vmfault(pagetable, va, !write) == 0) {
+            return 0;
+        }
+        pte = walk_lookup_level(pagetable, va, &level);
+    }
+    if((*pte & PTE_U) == 0)
+        return 0;
+    if(write) {
+        if(*pte & PTE_COW) {
+            if(uvmcow(pagetable, va) == 0)
+                return 0;
+            // 大页可能被拆开了
+            pte = walk_lookup_level(pagetable, va, &level);
+        }
+        // 禁止向只读用户代码页写入数据
+        if((*pte & PTE_W) == 0)
+            return 0;
+        *pte |= PTE_A | PTE_D;
+    }
+    return PTE2PA(*pte) + (PGROUNDDOWN(va) & (LEVELSIZE(level) - 1));
+}
 
-    while(len > 0){
-        va0 = PGROUNDDOWN(dstva); // 计算当前页的起始虚拟地址
-        if(va0 >= MAXVA)          // 检查虚拟地址是否越界
+// 同上，解析当前进程的页时持有它的地址空间锁
+static uint64
+uvm_resolve(pagetable_t pagetable, uint64 va, int write)
+{
+    struct proc *p = myproc();
+
+    if(p == 0 || p->pagetable != pagetable)
+        return uvm_resolve_page(pagetable, va, write);
+    uvm_lock(p);
+    uint64 pa = uvm_resolve_page(pagetable, va, write);
+    uvm_unlock(p);
+    return pa;
+}
+
+// 用户地址 [va, va+len) 是否完全落在用户可以使用的区域（堆以下或者 mmap 区域）
+// 内核视图页表中其余的地址是内核自己的映射，绝不能让用户借系统调用访问
+static int
+uaccess_ok(uint64 va, uint64 len)
+{
+    if(va + len < va)
+        return 0;
+    return va + len <= UHEAPTOP || (va >= MMAPBASE && va + len <= MMAPTOP);
+}
+
+// 通过内核视图页表直接复制 len 字节，uva 是 dst/src 中属于用户的那一个
+// 出错时解析出错的那一页再继续，解析之后仍然没有进展说明无法访问
+static int
+uvm_copy_direct(pagetable_t pagetable, char *dst, const char *src, uint64 len, uint64 uva, int write)
+{
+    uint64 left, done;
+    uint64 fault = 1;   // 上次解析过的用户页，1 不是页地址
+
+    while(len > 0) {
+        if((left = __copy_user(dst, src, len)) == 0)
+            break;
+        done = len - left;
+        dst += done;
+        src += done;
+        uva += done;
+        len = left;
+        if(done == 0 && PGROUNDDOWN(uva) == fault)
             return -1;
-    
-        pa0 = walkaddr(pagetable, va0); // 获取虚拟地址对应的物理地址
-        if(pa0 == 0) {                  // 如果没有映射，尝试缺页处理
-            if((pa0 = vmfault(pagetable, va0, 0)) == 0) {
-                return -1;                  // 缺页处理失败
+        fault = PGROUNDDOWN(uva);
+        if(uvm_resolve(pagetable, fault, write) == 0)
+            return -1;
+    }
+    return 0;
+}
+
+// 逐页遍历页表，通过物理地址在 va 开始的用户空间和 niov 段内核缓冲区之间拷贝
+static int
+uvm_copyv_walk(pagetable_t pagetable, uint64 va, struct kvec *iov, int niov, int write)
+{
+    uint64 va0 = 1;     // 当前已解析的用户页，1 不是页地址，保证第一次会解析
+    uint64 pa0 = 0;
+
+    for(int i = 0; i < niov; i++) {
+        char *k = iov[i].base;
+        uint64 len = iov[i].len;
+
+        while(len > 0) {
+            if(PGROUNDDOWN(va) != va0) {
+                va0 = PGROUNDDOWN(va);
+                if((pa0 = uvm_resolve(pagetable, va0, write)) == 0)
+                    return -1;
             }
+            uint64 n = PGSIZE - (va - va0);  // 本页剩余的字节数
+            if(n > len)
+                n = len;
+            if(write)
+                memcpy((char *)(pa0 + (va - va0)), k, n);
+            else
+                memcpy(k, (char *)(pa0 + (va - va0)), n);
+            len -= n;
+            k += n;
+            va += n;
         }
+    }
+    return 0;
+}
 
-        pte = walk_lookup(pagetable, va0);  // 获取页表项指针
-        // 禁止向只读用户代码页写入数据
-        if((*pte & PTE_W) == 0)
+// 在从 va 开始的连续用户空间和 niov 段内核缓冲区之间拷贝
+// write 非 0 时从内核写到用户，否则从用户读到内核
+static int
+uvm_copyv(pagetable_t pagetable, uint64 va, struct kvec *iov, int niov, int write)
+{
+    struct proc *p = myproc();
+    uint64 total = 0;
+
+    if(p == 0 || p->pagetable != pagetable)
+        return uvm_copyv_walk(pagetable, va, iov, niov, write);
+
+    for(int i = 0; i < niov; i++)
+        total += iov[i].len;
+    if(!uaccess_ok(va, total))
+        return -1;
+    for(int i = 0; i < niov; i++) {
+        int r;
+        if(write)
+            r = uvm_copy_direct(pagetable, (char *)va, iov[i].base, iov[i].len, va, 1);
+        else
+            r = uvm_copy_direct(pagetable, iov[i].base, (char *)va, iov[i].len, va, 0);
+        if(r < 0)
             return -1;
-            
-        n = PGSIZE - (dstva - va0);     // 计算本页可拷贝的字节数
-        if(n > len)
-            n = len;
-        memmove((void *)(pa0 + (dstva - va0)), src, n); // 拷贝数据到用户空间
-
-        len -= n;       // 更新剩余字节数
-        src += n;       // 更新源地址指针
-        dstva = va0 + PGSIZE; // 移动到下一页
+        va += iov[i].len;
     }
     return 0;
 }
 
-/*
- * 从用户空间拷贝数据到内核空间。
- * 
- * 功能：
- *   从给定页表的虚拟地址 srcva 处，拷贝 len 字节数据到内核缓冲区 dst。
- *   支持跨页拷贝，自动处理页错误（如页未映射时尝试缺页处理）。
- * 
- * 参数：
- *   pagetable - 页表指针，指定用户空间的地址映射。
- *   dst       - 目标内核缓冲区指针，用于存放拷贝的数据。
- *   srcva     - 用户空间的源虚拟地址。
- *   len       - 需要拷贝的字节数。
- * 
- * 返回值：
- *   成功返回 0，失败（如地址无效或缺页处理失败）返回 -1。
- * 
- * 实现细节：
- *   1. 循环处理每一页，直到所有数据拷贝完成。
- *   2. 通过 walkaddr 获取虚拟地址对应的物理地址，若未映射则调用 vmfault 处理缺页。
- *   3. 计算本页可拷贝的字节数 n，避免跨页越界。
- *   4. 使用 memmove 进行实际数据拷贝。
- *   5. 更新剩余字节数、目标地址和源虚拟地址，进入下一页处理。
- */
+// 从内核缓冲区 src 拷贝 len 字节到用户空间 dstva
+// 成功返回 0，地址无效、缺页处理失败或者目标页不可写时返回 -1
 int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+    struct kvec iov = { src, len };
+    return uvm_copyv(pagetable, dstva, &iov, 1, 1);
+}
 
-  while(len > 0){
-    va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
-      return -1;
-    n = PGSIZE - (srcva - va0);
-    if(n > len)
-      n = len;
-    memmove(dst, (char *)(pa0 + (srcva - va0)), n);
+// 把 niov 段内核缓冲区依次拷贝到从 dstva 开始的用户空间
+int
+copyoutv(pagetable_t pagetable, uint64 dstva, struct kvec *iov, int niov)
+{
+    return uvm_copyv(pagetable, dstva, iov, niov, 1);
+}
 
-    len -= n;
-    dst += n;
-    srcva += n;
-  }
-  return 0;
+// 从用户空间 srcva 拷贝 len 字节到内核缓冲区 dst
+// 成功返回 0，失败（如地址无效或缺页处理失败）返回 -1
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+    struct kvec iov = { dst, len };
+    return uvm_copyv(pagetable, srcva, &iov, 1, 0);
 }
 
+// 把从 srcva 开始的用户空间依次拷贝到 niov 段内核缓冲区
 int
-copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+copyinv(pagetable_t pagetable, struct kvec *iov, int niov, uint64 srcva)
+{
+    return uvm_copyv(pagetable, srcva, iov, niov, 0);
+}
+
+// 8 字节中是否有为 0 的字节
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
+// 逐页遍历页表复制字符串，每页先按字查找结尾，再整段复制
+static int
+copyinstr_walk(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
-  int got_null = 0;
 
-  while(got_null == 0 && max > 0){
+  while(max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = uvm_resolve(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
-      }
-      --n;
-      --max;
-      p++;
-      dst++;
+    uint64 len = 0;
+    // 字节扫描到 8 字节对齐，然后逐字扫描，找到含 0 的字后再逐字节定位
+    while(len < n && ((uint64)(p + len) & 7) && p[len] != '\0')
+      len++;
+    if(len < n && ((uint64)(p + len) & 7) == 0){
+      while(len + 8 <= n && !HASZERO(*(uint64 *)(p + len)))
+        len += 8;
+      while(len < n && p[len] != '\0')
+        len++;
     }
 
-    srcva = va0 + PGSIZE;
+    if(len < n){
+      // 找到了结尾的 0，连同它一起复制
+      memcpy(dst, p, len + 1);
+      return 0;
+    }
+    memcpy(dst, p, n);
+    dst += n;
+    max -= n;
+    srcva += n;
   }
-  if(got_null){
-    return 0;
-  } else {
+  return -1;
+}
+
+// 从用户空间拷贝以 0 结尾的字符串，最多 max 字节（包括结尾的 0）
+int
+copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  struct proc *p = myproc();
+  uint64 left, done;
+  uint64 fault = 1;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return copyinstr_walk(pagetable, dst, srcva, max);
+
+  // 查找范围截断在所在的用户区域之内
+  if(srcva < UHEAPTOP)
+    max = max < UHEAPTOP - srcva ? max : UHEAPTOP - srcva;
+  else if(srcva >= MMAPBASE && srcva < MMAPTOP)
+    max = max < MMAPTOP - srcva ? max : MMAPTOP - srcva;
+  else
     return -1;
+
+  while(max > 0){
+    left = __copy_user_str(dst, (char *)srcva, max);
+    done = max - left;
+    if(done > 0 && dst[done - 1] == '\0')
+      return 0;
+    if(left == 0)
+      return -1;    // max 字节内没有结尾
+    // 读 srcva + done 时出错
+    dst += done;
+    srcva += done;
+    max = left;
+    if(done == 0 && PGROUNDDOWN(srcva) == fault)
+      return -1;
+    fault = PGROUNDDOWN(srcva);
+    if(uvm_resolve(pagetable, fault, 0) == 0)
+      return -1;
   }
+  return -1;
 }
 
+// 缺页处理：va 在进程大小之内但还没有映射时，分配一页清零的内存，
+// 被换出时从交换区读回来
+// 返回新页的物理地址，va 非法或内存不足时返回 0
 uint64
 vmfault(pagetable_t pagetable, uint64 va, int read)
 {
   uint64 mem;
   struct proc *p = myproc();
+  pte_t *pte;
+  int level;
 
   if (va >= p->sz)
-    return 0;
+    return mmap_fault(p, va, read, 1);   // 可能位于 mmap 区域
   va = PGROUNDDOWN(va);
-  if(ismapped(pagetable, va)) {
-    return 0;
+  pte = walk_lookup_level(pagetable, va, &level);
+  if(pte && (*pte & PTE_V) == 0 && (*pte & PTE_SWAP))
+    return swap_in(pagetable, va, pte);
+  if(pte && (*pte & PTE_V)) {
+    // 不自动维护 A/D 位的硬件在 A 为 0（或写入时 D 为 0）时也会报缺页，
+    // 由软件置位后重新执行；其余情况是真正的权限错误
+    uint64 ad = read ? PTE_A : PTE_A | PTE_D;
+    if((*pte & PTE_U) == 0 || (*pte & ad) == ad || (!read && (*pte & PTE_W) == 0))
+      return 0;
+    *pte |= ad;
+    uvm_changed(pagetable, va);
+    return PTE2PA(*pte) + (va & (LEVELSIZE(level) - 1));
   }
-  mem = (uint64) kalloc();
+  // 读缺页只映射共享的零页，真正写入时再分配
+  if(read)
+    return uvm_mapzero(p->pagetable, va, PTE_R, 1);
+  mem = (uint64) swap_kalloc(1);
   if(mem == 0)
     return 0;
-  memset((void *) mem, 0, PGSIZE);
-  if (map_page(p->pagetable, va, mem, PTE_W|PTE_U|PTE_R) != 0) {
+  kpage_settype((void *)mem, PG_USER);
+  if (map_page(p->pagetable, va, mem, PTE_W|PTE_U|PTE_R|PTE_A|PTE_D) != 0) {
     kfree((void *)mem);
     return 0;
   }
+  // 这一页填满了所在的 2MB 区域时合并成大页，原来的页已经释放
+  uint64 blk = uvm_promote(p->pagetable, va, p->sz);
+  if(blk)
+    mem = blk + (va & (LEVELSIZE(1) - 1));
   return mem;
 }
 